@@ -1,13 +1,19 @@
 #pragma once
 
+#include "timer_wheel.hpp"
+#include <atomic>
 #include <cstring>
 #include <functional>
-#include <map>
+#include <limits>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <thread>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 struct epoll_exception : public std::runtime_error {
@@ -16,13 +22,64 @@ struct epoll_exception : public std::runtime_error {
 };
 
 class epoll {
-  int ep, ev;
-  std::map<int, size_t> type_map;
+  static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+  int ep, ev, tfd;
+  // callback index for each registered fd, npos if unregistered
+  std::vector<size_t> type_map;
   std::vector<std::function<void(epoll_event const &)>> callbacks;
+  std::vector<epoll_event> events;
+  size_t cursor = 0, pending = 0;
   bool stop = false;
+  std::atomic<bool> stopping{ false };
+  // thread inside wait(), if any
+  std::atomic<std::thread::id> loop;
+  std::vector<std::function<void()>> deferred;
+  timer_wheel timers;
+  // expiry the timerfd is set to
+  timer_wheel::clock::time_point armed = timer_wheel::clock::time_point::max();
+
+  // tasks from other threads are pushed onto a lock-free stack, newest first;
+  // the loop takes the whole stack at once and keeps it in ready in posting order
+  struct task {
+    std::function<void()> fn;
+    task *next;
+  };
+  std::atomic<task *> posted{ nullptr };
+  task *ready = nullptr;
+
+  // runs what a throwing task left in ready, then one batch taken from the stack
+  inline void run_posted() {
+    for (bool taken = false;; taken = true) {
+      while (ready) {
+        std::unique_ptr<task> current{ std::exchange(ready, ready->next) };
+        current->fn();
+      }
+      if (taken || !posted.load(std::memory_order_relaxed)) return;
+      for (auto list = posted.exchange(nullptr, std::memory_order_acquire); list;) {
+        auto next  = list->next;
+        list->next = ready;
+        ready      = list;
+        list       = next;
+      }
+    }
+  }
+
+  static inline void release(task *list) {
+    while (list) delete std::exchange(list, list->next);
+  }
+
+  inline void run_deferred() {
+    while (!deferred.empty()) {
+      auto list = std::move(deferred);
+      deferred.clear();
+      for (auto &fn : list) fn();
+    }
+  }
 
 public:
-  inline epoll() {
+  inline epoll(size_t batch = 64)
+      : events(batch ? batch : 1) {
     ep = epoll_create1(EPOLL_CLOEXEC);
     if (ep == -1) throw epoll_exception("epoll_create");
     ev = eventfd(0, EFD_CLOEXEC);
@@ -30,7 +87,16 @@ public:
     add(EPOLLIN, ev, reg([this](auto) {
           uint64_t count;
           read(ev, &count, sizeof(count));
-          stop = true;
+          run_posted();
+          if (stopping.load(std::memory_order_acquire)) stop = true;
+        }));
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) throw epoll_exception("timerfd_create");
+    add(EPOLLIN, tfd, reg([this](auto) {
+          uint64_t count;
+          read(tfd, &count, sizeof(count));
+          armed = timer_wheel::clock::time_point::max();
+          timers.advance(timer_wheel::clock::now());
         }));
   }
 
@@ -38,6 +104,9 @@ public:
   epoll &operator=(epoll const &) = delete;
 
   inline ~epoll() {
+    release(ready);
+    release(posted.exchange(nullptr));
+    close(tfd);
     close(ev);
     close(ep);
   }
@@ -45,12 +114,21 @@ public:
   inline void add(uint32_t events, int fd, int type) {
     epoll_event event = { .events = events, .data = { .fd = fd } };
     if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &event) != 0) throw epoll_exception("epoll_ctl");
+    if (static_cast<size_t>(fd) >= type_map.size()) type_map.resize(fd + 1, npos);
     type_map[fd] = type;
   }
 
+  inline void mod(uint32_t events, int fd) {
+    epoll_event event = { .events = events, .data = { .fd = fd } };
+    if (epoll_ctl(ep, EPOLL_CTL_MOD, fd, &event) != 0) throw epoll_exception("epoll_ctl");
+  }
+
   inline void del(int fd) {
     epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
-    type_map.erase(fd);
+    if (static_cast<size_t>(fd) < type_map.size()) type_map[fd] = npos;
+    // the fd number may be reused before the rest of the batch is dispatched
+    for (size_t i = cursor + 1; i < pending; i++)
+      if (events[i].data.fd == fd) events[i].events = 0;
   }
 
   inline size_t reg(std::function<void(epoll_event const &)> callback) {
@@ -58,18 +136,78 @@ public:
     return callbacks.size() - 1;
   }
 
+  // runs fn after the current batch of events, before the loop blocks again; loop thread only
+  inline void defer(std::function<void()> fn) { deferred.emplace_back(std::move(fn)); }
+
+  // runs fn on the loop thread, callable from any thread; tasks posted by one thread run in order
+  inline void post(std::function<void()> fn) {
+    auto node = new task{ std::move(fn), nullptr };
+    auto head = posted.load(std::memory_order_relaxed);
+    do
+      node->next = head;
+    while (!posted.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+    // only the task that finds the stack empty has to wake the loop; node may already be taken and gone
+    if (!head) wake();
+  }
+
+  using timer = timer_wheel::handle;
+
+  // runs fn on the loop thread once delay has passed, then every period if it is not zero; loop thread only
+  inline timer schedule(timer_wheel::clock::duration delay, std::function<void()> fn, timer_wheel::clock::duration period = {}) {
+    return timers.schedule(delay, std::move(fn), period);
+  }
+
+  // false if the timer already fired or was cancelled; loop thread only
+  inline bool cancel(timer handle) { return timers.cancel(handle); }
+
+  // true on the thread running wait()
+  inline bool in_loop() const { return loop.load(std::memory_order_relaxed) == std::this_thread::get_id(); }
+
   inline void wait() {
+    loop = std::this_thread::get_id();
     while (!stop) {
-      epoll_event event = {};
-      auto ret          = epoll_wait(ep, &event, 1, -1);
-      if (ret > 0) callbacks[type_map[event.data.fd]](event);
+      run_posted();
+      run_deferred();
+      if (stop) break;
+      rearm();
+      auto ret = epoll_wait(ep, events.data(), events.size(), -1);
+      if (ret <= 0) continue;
+      for (cursor = 0, pending = ret; cursor < pending && !stop; cursor++) {
+        auto const &event = events[cursor];
+        if (!event.events) continue;
+        if (auto type = type_map[event.data.fd]; type != npos) callbacks[type](event);
+      }
+      cursor = pending = 0;
     }
+    loop = std::thread::id{};
   }
 
-  inline bool has(int fd) { return type_map.find(fd) != type_map.end(); }
+  inline bool has(int fd) { return static_cast<size_t>(fd) < type_map.size() && type_map[fd] != npos; }
 
   inline void shutdown() {
+    stopping.store(true, std::memory_order_release);
+    wake();
+  }
+
+private:
+  // points the timerfd at the next slot of the wheel that has work
+  inline void rearm() {
+    auto next = timers.next();
+    if (next == armed) return;
+    armed           = next;
+    itimerspec spec = {};
+    if (next != timer_wheel::clock::time_point::max()) {
+      auto since    = next.time_since_epoch();
+      auto secs     = std::chrono::duration_cast<std::chrono::seconds>(since);
+      spec.it_value = { secs.count(), std::chrono::duration_cast<std::chrono::nanoseconds>(since - secs).count() };
+      // an all zero value would disarm the timer instead
+      if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec) spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) throw epoll_exception("timerfd_settime");
+  }
+
+  inline void wake() {
     uint64_t count = 1;
     write(ev, &count, 8);
   }
-};
\ No newline at end of file
+};
@@ -2,14 +2,17 @@
 
 #include "json.hpp"
 #include "promise.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <regex>
-#include <set>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
@@ -30,25 +33,79 @@ struct RemoteException : std::runtime_error {
       , full(ex) {}
 };
 
+struct CallTimeout : std::runtime_error {
+  inline CallTimeout(std::string const &method)
+      : runtime_error("call timed out: " + method) {}
+};
+
+struct ConnectionClosed : std::runtime_error {
+  inline ConnectionClosed()
+      : runtime_error("connection closed") {}
+};
+
+// thrown by handlers that gave up on a cancelled request
+struct Cancelled : std::runtime_error {
+  inline Cancelled()
+      : runtime_error("request cancelled") {}
+};
+
 enum struct message_type { TEXT, BINARY };
 
+// Envelope encoding negotiated as a subprotocol, binary codecs travel in binary frames
+enum struct codec { JSON, CBOR, MSGPACK };
+inline constexpr char cbor_protocol[]    = "jsonrpc.cbor";
+inline constexpr char msgpack_protocol[] = "jsonrpc.msgpack";
+
+inline codec codec_for(std::string_view protocol) {
+  if (protocol == cbor_protocol) return codec::CBOR;
+  if (protocol == msgpack_protocol) return codec::MSGPACK;
+  return codec::JSON;
+}
+
 struct server_io {
   struct client;
   using recv_fn   = std::function<void(std::shared_ptr<client>, std::string_view, message_type type)>;
   using accept_fn = std::function<void(std::shared_ptr<client>)>;
   using remove_fn = std::function<void(std::shared_ptr<client>)>;
+  using timer_id  = uint64_t;
+  // message encoded once and shared by every client it is sent to
+  struct prepared {
+    std::string data;
+    message_type type;
+    inline prepared(std::string data, message_type type)
+        : data(std::move(data))
+        , type(type) {}
+    inline virtual ~prepared() {}
+    // the message as passed to prepare()
+    inline virtual std::string_view payload() const { return data; }
+  };
   struct client {
     inline virtual ~client(){};
     virtual void shutdown()                                                     = 0;
     virtual void send(std::string_view, message_type type = message_type::TEXT) = 0;
+    inline virtual void send(std::shared_ptr<prepared const> const &msg) { send(msg->payload(), msg->type); }
+    // subprotocol picked during the handshake, empty if none
+    inline virtual std::string_view protocol() const { return {}; }
+    // runs fn on the thread that serves this client, callable from any thread; right away without one
+    inline virtual void post(std::function<void()> fn) { fn(); }
+    // runs fn on that thread once delay has passed, callable from any thread; 0 when the transport has no timers
+    inline virtual timer_id schedule(std::chrono::milliseconds, std::function<void()>) { return 0; }
+    // a timer that already fired is left alone
+    inline virtual void cancel(timer_id) {}
   };
   inline virtual ~server_io() {}
   virtual void shutdown()                            = 0;
   virtual void accept(accept_fn, remove_fn, recv_fn) = 0;
+  // subprotocols clients may pick, set before accept()
+  inline virtual void protocols(std::vector<std::string>) {}
+  inline virtual std::shared_ptr<prepared const> prepare(std::string_view data, message_type type = message_type::TEXT) {
+    return std::make_shared<prepared>(std::string{ data }, type);
+  }
 };
 
 struct client_io {
-  using recv_fn = std::function<void(std::string_view, message_type type)>;
+  using recv_fn  = std::function<void(std::string_view, message_type type)>;
+  using timer_id = uint64_t;
 
   inline virtual ~client_io(){};
   virtual void shutdown()                                                     = 0;
@@ -56,12 +113,24 @@ struct client_io {
   virtual void send(std::string_view, message_type type = message_type::TEXT) = 0;
   virtual bool alive()                                                        = 0;
   virtual void ondie(std::function<void()>)                                   = 0;
+  // runs fn once the current event loop turn is over, right away without a loop; callable from any thread
+  inline virtual void defer(std::function<void()> fn) { fn(); }
+  // subprotocol the server picked, empty if none
+  inline virtual std::string_view protocol() const { return {}; }
+  // runs fn on the event loop once delay has passed, callable from any thread; 0 when the transport has no timers
+  inline virtual timer_id schedule(std::chrono::milliseconds, std::function<void()>) { return 0; }
+  // a timer that already fired is left alone
+  inline virtual void cancel(timer_id) {}
 };
 
-template <class T> struct wptr_less_than {
-  inline bool operator()(const std::weak_ptr<T> &lhs, const std::weak_ptr<T> &rhs) const {
-    return lhs.expired() || (!rhs.expired() && lhs.lock() < rhs.lock());
-  }
+// Regex route that keeps its source, so the router can index its literal prefix
+struct route {
+  std::string source;
+  std::regex regex;
+
+  route(std::string source, std::regex::flag_type flags = std::regex::ECMAScript);
+  // literal text every match starts with, empty when unknown
+  std::string prefix() const;
 };
 
 class RPC {
@@ -73,19 +142,89 @@ public:
     virtual void on_binary(client_handler, std::string_view data){};
   };
 
+  // One request as seen by a handler that asks for it. It is cancelled when the client
+  // goes away, sends rpc.cancel with its id or the deadline passes.
+  class context {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    context(json id, clock::time_point deadline);
+    // null for notifications
+    inline json const &id() const { return request_id; }
+    inline clock::time_point deadline() const { return due; }
+    bool cancelled() const;
+    // fn runs once on the cancelling thread, right away if the request is already cancelled
+    void on_cancel(std::function<void()> fn);
+    void cancel();
+
+  private:
+    json request_id;
+    clock::time_point due;
+    std::atomic<bool> flag{ false };
+    std::mutex mtx;
+    std::vector<std::function<void()>> listeners;
+  };
+  using context_ref = std::shared_ptr<context>;
+
 private:
-  using maybe_async_handler = std::variant<std::function<json(client_handler, json)>, std::function<promise<json>(client_handler, json)>>;
+  using maybe_async_handler = std::variant<std::function<json(client_handler, json)>, std::function<promise<json>(client_handler, json)>,
+                                           std::function<json(client_handler, json, context_ref)>,
+                                           std::function<promise<json>(client_handler, json, context_ref)>>;
   using maybe_async_proxy_handler =
-      std::variant<std::function<json(client_handler, std::smatch, json)>, std::function<promise<json>(client_handler, std::smatch, json)>>;
+      std::variant<std::function<json(client_handler, std::smatch, json)>, std::function<promise<json>(client_handler, std::smatch, json)>,
+                   std::function<json(client_handler, std::smatch, json, context_ref)>,
+                   std::function<promise<json>(client_handler, std::smatch, json, context_ref)>>;
   using callback_ref_t = std::shared_ptr<callback>;
   std::recursive_mutex mtx;
   std::unique_ptr<server_io> io;
-  std::map<std::string, maybe_async_handler> methods;
-  std::vector<std::tuple<std::regex, maybe_async_proxy_handler, size_t>> proxied_methods;
-  std::vector<std::string> server_events;
-  std::map<std::string, std::set<std::weak_ptr<server_io::client>, wptr_less_than<server_io::client>>> server_event_map;
+  // a null pool runs the handler inline on the thread that received the request
+  struct method {
+    maybe_async_handler handler;
+    std::shared_ptr<thread_pool> pool;
+  };
+  struct proxied {
+    std::string prefix;
+    std::regex regex;
+    maybe_async_proxy_handler handler;
+    std::shared_ptr<thread_pool> pool;
+    size_t uid;
+  };
+  // routes indexed by literal prefix, nodes[0] is the root
+  struct trie {
+    struct node {
+      std::map<char, size_t> children;
+      std::vector<size_t> routes;
+    };
+    std::vector<node> nodes{ 1 };
+
+    void insert(std::string_view prefix, size_t route);
+    // indices of the routes whose prefix starts name, in registration order
+    void candidates(std::string_view name, std::vector<size_t> &out) const;
+  };
+  // Immutable snapshot of the registered methods, reg/unreg swap in a new one so dispatch never locks
+  struct registry {
+    std::map<std::string, method> names; // owns the keys of methods
+    std::unordered_map<std::string_view, method const *> methods;
+    std::vector<proxied> proxied_methods;
+    trie router;
+  };
+  std::shared_ptr<registry const> table = std::make_shared<registry>();
+  // subscribers of one event, kept dense so emit walks contiguous memory
+  struct subscriber {
+    client_handler client;
+    codec format;
+  };
+  struct topic {
+    std::vector<subscriber> clients;
+    std::unordered_map<server_io::client *, size_t> position; // index in clients, the connection is the key
+
+    void add(client_handler const &);
+    bool remove(server_io::client *);
+  };
+  std::map<std::string, topic, std::less<>> server_events;
   callback_ref_t callback_ref;
-  size_t unqid;
+  size_t unqid = 0;
+  std::shared_ptr<thread_pool> shared_pool;
 
 public:
   RPC(decltype(io) &&io, callback_ref_t handler = std::make_shared<callback>());
@@ -96,10 +235,16 @@ public:
 
   void event(std::string_view);
   void emit(std::string const &, json data);
-  void reg(std::string_view, maybe_async_handler);
-  size_t reg(std::regex, maybe_async_proxy_handler);
+  // handlers given a pool run on its workers, pass workers() for the shared one or a dedicated pool
+  void reg(std::string_view, maybe_async_handler, std::shared_ptr<thread_pool> pool = nullptr);
+  size_t reg(std::regex, maybe_async_proxy_handler, std::shared_ptr<thread_pool> pool = nullptr);
+  size_t reg(route, maybe_async_proxy_handler, std::shared_ptr<thread_pool> pool = nullptr);
   void unreg(std::string const &);
   void unreg(size_t);
+  // shared worker pool, started on first use
+  std::shared_ptr<thread_pool> workers();
+  // contexts of requests running longer than this are cancelled, zero (the default) means no deadline
+  void deadline(std::chrono::milliseconds);
 
   void start();
   void stop();
@@ -115,12 +260,24 @@ public:
     using callback_ref_t = std::shared_ptr<callback>;
 
   private:
+    // a call waiting for its answer, timer is 0 without a timeout
+    struct pending {
+      promise<json>::resolver resolver;
+      client_io::timer_id timer;
+    };
+
     std::recursive_mutex mtx;
     std::unique_ptr<client_io> io;
     std::map<std::string, data_fn> event_map;
-    std::map<unsigned, promise<json>::resolver> regmap;
+    std::map<unsigned, pending> regmap;
     callback_ref_t callback_ref;
-    unsigned last_id;
+    unsigned last_id = 0;
+    std::chrono::milliseconds default_timeout{ 0 };
+    bool closed         = false;
+    size_t coalesce_max = 0;
+    json outgoing       = json::array();
+    // deferred flushes hold it weakly, so they do nothing once the client is gone
+    std::shared_ptr<Client *> self = std::make_shared<Client *>(this);
 
   public:
     Client(decltype(io) &&io, callback_ref_t handler = std::make_shared<callback>());
@@ -129,8 +286,29 @@ public:
     Client(const Client &) = delete;
     Client &operator=(const Client &) = delete;
 
+    // Calls and notifications collected by batch() and sent as one frame when it returns.
+    // Chain the returned promises inside the builder, their resolvers are registered when they are consumed.
+    class Batch {
+      Client &client;
+      json requests = json::array();
+
+      Batch(Client &client);
+      friend class Client;
+
+    public:
+      promise<json> call(std::string const &name, json data);
+      void notify(std::string_view name, json data);
+    };
+
     promise<json> call(std::string const &name, json data);
+    // rejected with CallTimeout and forgotten unless answered within timeout, zero waits forever
+    promise<json> call(std::string const &name, json data, std::chrono::milliseconds timeout);
     void notify(std::string_view name, json data);
+    // timeout of calls that do not pass their own, batched ones included; zero (the default) waits forever
+    void timeout(std::chrono::milliseconds);
+    void batch(std::function<void(Batch &)>);
+    // calls and notifications issued in one event loop turn go out as one batch, max requests per frame; 0 turns it off
+    void coalesce(size_t max = 64);
     promise<bool> on(std::string_view name, data_fn);
     promise<bool> off(std::string const &name);
 
@@ -141,10 +319,38 @@ public:
 
   private:
     void incoming(std::string_view, message_type);
+    void handle(json);
+    // registers the resolver of call id, false if the connection is already gone and the call was rejected
+    bool expect(unsigned id, std::string const &name, promise<json>::resolver, std::chrono::milliseconds timeout);
+    void expire(unsigned id, std::string const &name);
+    // rejects every call still waiting with ConnectionClosed
+    void abandon();
+    void send(json request);
+    void flush();
+    void write(json const &);
   };
 
 private:
+  // receives the response of one request, null when nothing is to be sent
+  using reply_fn = std::function<void(json)>;
+  // a request of a handler taking a context, whoever takes it out of inflight answers it
+  struct running {
+    context_ref ctx;
+    reply_fn reply;
+  };
+  std::mutex running_mtx;
+  std::unordered_map<server_io::client *, std::vector<running>> inflight;
+  std::chrono::milliseconds request_deadline{ 0 };
+
+  bool untrack(server_io::client *, context const &);
+  bool cancel(server_io::client *, json const &id);
+  void abandon(server_io::client *);
+
+  void update(std::function<void(registry &)>);
   void incoming(client_handler, std::string_view, message_type);
+  void dispatch(client_handler, std::string_view, reply_fn);
+  void dispatch(client_handler, json, reply_fn);
+  void invoke(client_handler, std::string_view method, std::string_view raw_params, json params, bool has_id, json id, reply_fn);
 };
 
 } // namespace rpc
\ No newline at end of file
@@ -3,11 +3,19 @@
 #include "epoll.hpp"
 #include "rpc.hpp"
 #include "ws.hpp"
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <exception>
 #include <filesystem>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <sys/uio.h>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #ifndef OPENSSL_ENABLED
@@ -60,16 +68,63 @@ public:
   InvalidFrame();
 };
 
+class BufferOverflow : public std::runtime_error {
+public:
+  BufferOverflow();
+};
+
+// Receive slabs shared by the connections of one reactor; not thread safe,
+// use it only from the thread running that reactor.
+class BufferPool {
+  std::vector<char *> idle;
+  size_t slab, max_idle;
+  size_t borrowed = 0, created = 0, reused = 0;
+
+public:
+  struct stats {
+    size_t slab;     // size of a pooled slab
+    size_t idle;     // slabs kept for reuse
+    size_t borrowed; // storage currently held by buffers, including oversized ones
+    size_t created;  // allocations made by the pool
+    size_t reused;   // borrows served from idle slabs
+  };
+
+  BufferPool(size_t slab = 0x10000, size_t max_idle = 256);
+  BufferPool(BufferPool const &) = delete;
+  BufferPool &operator=(BufferPool const &) = delete;
+  // capacity is raised to the slab size when it fits in one
+  char *acquire(size_t &capacity);
+  void release(char *data, size_t capacity);
+  stats statistics() const;
+  ~BufferPool();
+};
+
+// Receive buffer: drop() only advances the read position, the unread tail is
+// moved to the front at most once per allocate(), and capacity grows geometrically.
+// Holding more than limit unread bytes throws BufferOverflow.
+// With a pool the storage is borrowed while data is pending and returned once drained.
 class Buffer {
+  std::shared_ptr<BufferPool> pool;
   char *start     = nullptr;
   char *head      = nullptr;
+  char *tail      = nullptr;
   char *allocated = nullptr;
+  size_t limit;
 
 public:
-  Buffer();
+  static constexpr size_t default_limit = 64 << 20;
+
+  Buffer(size_t limit = default_limit);
+  Buffer(std::shared_ptr<BufferPool> pool, size_t limit = default_limit);
+  Buffer(Buffer const &) = delete;
+  Buffer &operator=(Buffer const &) = delete;
+  // at least size free bytes after end(), space() tells how many there are
   char *allocate(size_t size);
+  size_t space() const;
   void eat(size_t size);
   void drop(size_t size);
+  // gives pooled storage back if nothing is pending
+  void release();
   void reset();
   char *begin() const;
   char *end() const;
@@ -78,77 +133,262 @@ public:
   operator std::string_view() const;
   ~Buffer();
 };
+
+// Outbound bytes that the socket did not accept yet
+class WriteQueue {
+  // either a private copy or a view kept alive by owner
+  struct chunk {
+    std::string copy;
+    std::shared_ptr<void const> owner;
+    std::string_view shared;
+
+    inline std::string_view data() const { return owner ? shared : copy; }
+  };
+  std::deque<chunk> chunks;
+  size_t offset = 0;
+  size_t queued = 0;
+
+public:
+  void push(std::string_view data);
+  void push(std::shared_ptr<void const> owner, std::string_view data);
+  size_t gather(iovec *iov, size_t max) const;
+  void consume(size_t size);
+  size_t length() const;
+  bool empty() const;
+};
+
+// Queued bytes above high mark the connection congested until they drain below low
+struct watermark {
+  size_t low  = 0;
+  size_t high = std::numeric_limits<size_t>::max();
+};
+
+// Server side liveness checks, done by one periodic sweep over all connections of a reactor.
+// Without pings the sweep runs every idle / 2, otherwise every ping and idle is checked then.
+struct keepalive {
+  std::chrono::milliseconds ping{ 0 }; // interval between pings, zero sends none
+  unsigned missed = 2;                 // pings in a row answered by nothing before the connection is dropped
+  std::chrono::milliseconds idle{ 0 }; // drop connections without messages for this long, zero keeps them
+};
 #if OPENSSL_ENABLED
+// Server side session resumption: a ticket lets the client resume without server state,
+// the cache keeps sessions for clients that resume by session id.
+struct ssl_sessions {
+  bool tickets      = true;
+  size_t cache_size = 20480;            // sessions kept in the server cache, zero disables it
+  std::chrono::seconds timeout{ 7200 }; // how long a session or ticket can be resumed
+};
+struct ssl_client;
 struct ssl_context {
   SSL_CTX *ctx;
 
   ssl_context(std::filesystem::path cert, std::filesystem::path priv);
+  // a client context remembers the last session of every peer for the clients created from it
   ssl_context();
   ssl_context(ssl_context const &) = delete;
   ssl_context(ssl_context &&)      = delete;
   ~ssl_context();
+
+  // server only
+  void sessions(ssl_sessions config);
+  // hands record encryption to the kernel after the handshake where OpenSSL and the kernel support it
+  void ktls(bool enable);
+  // offers the session last negotiated with peer, if any, and keeps the one client gets for next time
+  void resume(ssl_client &client, std::string peer);
+
+private:
+  std::mutex mtx;
+  std::map<std::string, SSL_SESSION *> cache;
+
+  static int on_session(SSL *ssl, SSL_SESSION *session);
 };
 struct ssl_client {
   SSL *client;
+  // which readiness the handshake waits for after handshake() returned false
+  bool want_write = false;
+  // length of the last SSL_write that blocked, its retry has to offer at least as many bytes
+  size_t pending = 0;
+  // key of the session cache of the context, empty if not resuming
+  std::string peer;
+  // set once the handshake is done if the kernel encrypts what is written to the socket
+  bool kernel_send = false;
 
+  // the handshake is left to handshake(), as a client when do_connect is set
   ssl_client(ssl_context const &sslctx, int fd, bool do_connect = false);
   ssl_client(ssl_client const &) = delete;
   ssl_client(ssl_client &&)      = delete;
+  // advances the handshake as far as the socket allows, true once it is done
+  bool handshake();
+  // true if the handshake resumed an earlier session
+  bool resumed() const;
   void shutdown();
   ~ssl_client();
 };
 #endif
 
 struct server_wsio : server_io {
-  using cancel_fn = std::function<void(int)>;
+  using cancel_fn     = std::function<void(int)>;
+  struct client;
+  using congestion_fn = std::function<void(std::shared_ptr<client>, bool congested)>;
+
+  // a complete server frame, queued as is on every client it is sent to
+  struct prepared_frame : prepared {
+    size_t header;
+
+    prepared_frame(std::string data, message_type type, size_t header);
+    std::string_view payload() const override;
+  };
 
   struct client : server_io::client, std::enable_shared_from_this<client> {
     enum struct result { EMPTY, ACCEPT, STOPPED };
 
-    client(int, std::string_view);
+    client(int, std::string_view, std::shared_ptr<epoll>, std::shared_ptr<BufferPool>, std::vector<std::string> const *supported = nullptr);
 #if OPENSSL_ENABLED
-    client(std::shared_ptr<ssl_client> ssl, int, std::string_view);
+    client(std::shared_ptr<ssl_client> ssl, int, std::string_view, std::shared_ptr<epoll>, std::shared_ptr<BufferPool>,
+           std::vector<std::string> const *supported = nullptr);
 #endif
     ~client() override;
     void shutdown() override;
     void send(std::string_view, message_type type) override;
+    void send(std::shared_ptr<prepared const> const &) override;
+    std::string_view protocol() const override;
+    void post(std::function<void()>) override;
+    timer_id schedule(std::chrono::milliseconds, std::function<void()>) override;
+    void cancel(timer_id) override;
     result handle(recv_fn const &);
+    void flush();
+
+    void watermark(struct watermark, congestion_fn);
+    size_t buffered();
+    bool congested();
 
   private:
+    friend struct server_wsio;
+    result parse(recv_fn const &);
+#if OPENSSL_ENABLED
+    // drives the TLS handshake and the epoll interest it needs, true once the connection is secured
+    bool secure();
+#endif
+
+    void write(std::string_view header, std::string_view payload = {}, std::shared_ptr<void const> owner = {});
+    void write(Frame<Input> const &);
+    void notify(bool was_congested, bool congested);
+    // cancels every armed timer, on the loop thread
+    void disarm();
+
 #if OPENSSL_ENABLED
     std::shared_ptr<ssl_client> ssl;
+    bool secured = true;
 #endif
+    std::mutex send_mtx;
     int fd = {};
     std::string_view path;
+    std::vector<std::string> const *supported;
+    std::string subprotocol;
+    std::shared_ptr<epoll> ep;
     State state    = {};
     FrameType type = {};
     Buffer buffer;
+    WriteQueue queue;
+    bool polling_out  = false;
+    bool is_congested = false;
+    struct watermark marks;
+    congestion_fn on_congestion;
+    // keepalive bookkeeping, heard is set by any read and active by messages
+    bool heard = false, active = false, pinged = false;
+    unsigned missed = 0;
+    timer_wheel::clock::time_point last_active = timer_wheel::clock::now();
+    std::atomic<timer_id> last_timer{ 0 };
+    // armed timers, touched on the loop thread only
+    std::unordered_map<timer_id, epoll::timer> timers;
+  };
+
+  struct keepalive_stats {
+    size_t pings; // pings sent
+    size_t idle;  // connections dropped for sending no messages
+    size_t dead;  // connections dropped for answering no pings
   };
 
-  server_wsio(std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>());
+  server_wsio(std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>(), bool reuseport = false);
 #if OPENSSL_ENABLED
-  server_wsio(std::unique_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>());
+  server_wsio(std::shared_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>(),
+              bool reuseport = false);
 #endif
   ~server_wsio() override;
   void accept(accept_fn, remove_fn, recv_fn) override;
+  std::shared_ptr<prepared const> prepare(std::string_view data, message_type type = message_type::TEXT) override;
+  void protocols(std::vector<std::string>) override;
   void shutdown() override;
+  // applied to clients accepted afterwards
+  void watermark(struct watermark, congestion_fn = {});
+  // replaces the running sweep, callable from any thread
+  void keepalive(struct keepalive);
+  keepalive_stats keepalive_statistics() const;
 
   inline epoll &handler() { return *ep; }
+  inline BufferPool &pool() { return *buffers; }
 
 private:
+  using client_map = std::map<int, std::shared_ptr<client>>;
+
+  client_map::iterator drop(client_map::iterator);
+  void sweep();
+
   int fd;
   std::shared_ptr<epoll> ep;
-  std::map<int, std::shared_ptr<client>> fdmap;
+  std::shared_ptr<BufferPool> buffers = std::make_shared<BufferPool>();
+  std::vector<std::string> supported;
+  client_map fdmap;
+  remove_fn removed;
+  struct watermark marks;
+  congestion_fn on_congestion;
+  struct keepalive liveness;
+  epoll::timer sweeper;
+  std::atomic<size_t> pings{ 0 }, reaped_idle{ 0 }, reaped_dead{ 0 };
+  // tasks posted to the loop hold it weakly, so they do nothing once the server is gone
+  std::shared_ptr<server_wsio *> self = std::make_shared<server_wsio *>(this);
   std::string path;
 #if OPENSSL_ENABLED
   std::shared_ptr<ssl_context> ssl;
 #endif
 };
 
+// One server_wsio per shard, each with its own epoll and SO_REUSEPORT listener
+// on the same address; the kernel spreads incoming connections across them.
+struct sharded_server_wsio : server_io {
+  sharded_server_wsio(std::string_view address, size_t count = std::thread::hardware_concurrency());
+#if OPENSSL_ENABLED
+  sharded_server_wsio(std::shared_ptr<ssl_context> context, std::string_view address, size_t count = std::thread::hardware_concurrency());
+#endif
+  ~sharded_server_wsio() override;
+  void accept(accept_fn, remove_fn, recv_fn) override;
+  std::shared_ptr<prepared const> prepare(std::string_view data, message_type type = message_type::TEXT) override;
+  void protocols(std::vector<std::string>) override;
+  void shutdown() override;
+  void keepalive(struct keepalive);
+  // summed over the shards
+  server_wsio::keepalive_stats keepalive_statistics() const;
+  // runs the first shard on the calling thread until shutdown, then joins the others
+  void wait();
+
+  inline size_t size() const { return shards.size(); }
+  inline server_wsio &shard(size_t idx) { return *shards[idx]; }
+
+private:
+  void join();
+
+  std::vector<std::unique_ptr<server_wsio>> shards;
+  std::vector<std::thread> threads;
+  std::mutex mtx;
+  std::exception_ptr failure;
+};
+
 struct client_wsio : client_io {
-  client_wsio(std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>());
+  // protocols are offered to the server in order of preference
+  client_wsio(std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>(), std::vector<std::string> protocols = {});
 #if OPENSSL_ENABLED
-  client_wsio(std::unique_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>());
+  client_wsio(std::shared_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep = std::make_shared<epoll>(),
+              std::vector<std::string> protocols = {});
 #endif
   ~client_wsio();
   void shutdown() override;
@@ -156,16 +396,43 @@ struct client_wsio : client_io {
   void send(std::string_view, message_type type) override;
   bool alive() override;
   void ondie(std::function<void()>) override;
+  void defer(std::function<void()>) override;
+  std::string_view protocol() const override;
+  timer_id schedule(std::chrono::milliseconds, std::function<void()>) override;
+  void cancel(timer_id) override;
+
+  void watermark(struct watermark, std::function<void(bool congested)> = {});
+  size_t buffered();
+  bool congested();
 
   inline epoll &handler() { return *ep; }
 
 private:
+  void write(std::string_view);
+  void flush();
+  void notify(bool was_congested, bool congested);
+
   int fd;
   std::vector<std::function<void()>> ondie_cbs;
   std::shared_ptr<epoll> ep;
   std::string path, key;
-  Buffer buffer;
+  std::vector<std::string> offered;
+  std::string subprotocol;
+  Buffer buffer{ std::make_shared<BufferPool>(0x10000, 1) };
   State state = {};
+  std::mutex send_mtx;
+  WriteQueue queue;
+  bool polling_out  = false;
+  bool is_congested = false;
+  // whether the fd is in epoll, guarded by send_mtx so senders on other threads can check it
+  bool registered = false;
+  struct watermark marks;
+  std::function<void(bool)> on_congestion;
+  std::atomic<timer_id> last_timer{ 0 };
+  // armed timers, touched on the loop thread only
+  std::unordered_map<timer_id, epoll::timer> timers;
+  // tasks posted to the loop hold it weakly, so they do nothing once the client is gone
+  std::shared_ptr<client_wsio *> self = std::make_shared<client_wsio *>(this);
 #if OPENSSL_ENABLED
   std::shared_ptr<ssl_context> sslctx;
   std::shared_ptr<ssl_client> ssl;
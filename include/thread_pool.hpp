@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running queued tasks in submission order
+class thread_pool {
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  std::vector<std::thread> workers;
+  bool stop = false;
+
+public:
+  inline thread_pool(size_t count = std::thread::hardware_concurrency()) {
+    for (size_t i = 0; i < std::max(count, size_t(1)); i++)
+      workers.emplace_back([this] {
+        while (true) {
+          std::function<void()> task;
+          {
+            std::unique_lock lock{ mtx };
+            cv.wait(lock, [this] { return stop || !tasks.empty(); });
+            if (tasks.empty()) return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+          }
+          // tasks report their own failures
+          try {
+            task();
+          } catch (...) {}
+        }
+      });
+  }
+
+  thread_pool(thread_pool const &) = delete;
+  thread_pool &operator=(thread_pool const &) = delete;
+
+  // runs what is already queued, then joins the workers
+  inline ~thread_pool() {
+    {
+      std::lock_guard guard{ mtx };
+      stop = true;
+    }
+    cv.notify_all();
+    for (auto &worker : workers) worker.join();
+  }
+
+  inline void submit(std::function<void()> task) {
+    {
+      std::lock_guard guard{ mtx };
+      tasks.emplace_back(std::move(task));
+    }
+    cv.notify_one();
+  }
+
+  inline size_t size() const { return workers.size(); }
+};
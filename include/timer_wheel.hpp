@@ -0,0 +1,189 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Hierarchical timing wheel: eleven levels of 64 slots cover every 64-bit tick count.
+// A timer waits in the level of the highest base-64 digit where its expiry differs from
+// the current tick and moves down once the wheel reaches its slot.
+// Schedule and cancel are O(1); not thread safe.
+class timer_wheel {
+  static constexpr uint32_t npos  = std::numeric_limits<uint32_t>::max();
+  static constexpr size_t levels  = 11;
+  static constexpr uint64_t never = std::numeric_limits<uint64_t>::max();
+
+public:
+  using clock = std::chrono::steady_clock;
+
+  // valid until the timer fires or is cancelled, a reused entry gets a new generation
+  struct handle {
+    uint32_t index      = npos;
+    uint32_t generation = 0;
+  };
+
+private:
+  struct entry {
+    std::function<void()> fn;
+    uint64_t expiry = 0, period = 0;
+    uint32_t generation = 0;
+    // neighbours in the slot list, next is also the free list link
+    uint32_t prev = npos, next = npos;
+    uint16_t level = 0, digit = 0;
+    bool linked    = false;
+  };
+
+  clock::duration tick;
+  clock::time_point origin;
+  uint64_t current = 0;
+  size_t count     = 0;
+  std::vector<entry> entries;
+  uint32_t free_head = npos;
+  std::array<std::array<uint32_t, 64>, levels> slots;
+  std::array<uint64_t, levels> occupied = {};
+
+  inline uint64_t ticks(clock::time_point time) const { return (time - origin) / tick; }
+
+  inline void link(uint32_t index) {
+    auto &e    = entries[index];
+    auto diff  = e.expiry ^ current;
+    e.level    = diff ? (63 - __builtin_clzll(diff)) / 6 : 0;
+    e.digit    = (e.expiry >> (6 * e.level)) & 63;
+    auto &head = slots[e.level][e.digit];
+    e.prev     = npos;
+    e.next     = head;
+    if (head != npos) entries[head].prev = index;
+    head     = index;
+    e.linked = true;
+    occupied[e.level] |= uint64_t(1) << e.digit;
+  }
+
+  inline void unlink(uint32_t index) {
+    auto &e = entries[index];
+    if (e.prev != npos)
+      entries[e.prev].next = e.next;
+    else if ((slots[e.level][e.digit] = e.next) == npos)
+      occupied[e.level] &= ~(uint64_t(1) << e.digit);
+    if (e.next != npos) entries[e.next].prev = e.prev;
+    e.linked = false;
+  }
+
+  inline void release(uint32_t index) {
+    auto &e = entries[index];
+    e.fn    = nullptr;
+    e.generation++;
+    e.next    = free_head;
+    free_head = index;
+    count--;
+  }
+
+  // the tick at which the earliest occupied slot has to be looked at
+  inline uint64_t next_tick() const {
+    for (size_t level = 0; level < levels; level++) {
+      if (!occupied[level]) continue;
+      auto shift = 6 * level;
+      auto above = level + 1 < levels ? ~((uint64_t(1) << (shift + 6)) - 1) : 0;
+      return (current & above) | uint64_t(__builtin_ctzll(occupied[level])) << shift;
+    }
+    return never;
+  }
+
+  inline void fire(uint32_t index) {
+    auto &e = entries[index];
+    auto fn = std::move(e.fn);
+    if (!e.period) {
+      release(index);
+      return fn();
+    }
+    // periodic timers stay linked while they run, so the callback may cancel them
+    auto generation = e.generation;
+    e.expiry        = std::max(e.expiry + e.period, current + 1);
+    link(index);
+    auto restore = [&] {
+      if (entries[index].generation == generation) entries[index].fn = std::move(fn);
+    };
+    try {
+      fn();
+    } catch (...) {
+      restore();
+      throw;
+    }
+    restore();
+  }
+
+  // moves the timers of slots starting at the current tick down, then runs the due ones
+  inline void expire() {
+    for (size_t level = levels - 1; level > 0; level--) {
+      if (current & ((uint64_t(1) << (6 * level)) - 1)) continue;
+      auto &head = slots[level][(current >> (6 * level)) & 63];
+      auto index = std::exchange(head, npos);
+      occupied[level] &= ~(uint64_t(1) << ((current >> (6 * level)) & 63));
+      while (index != npos) link(std::exchange(index, entries[index].next));
+    }
+    auto &due = slots[0][current & 63];
+    while (due != npos) {
+      auto index = due;
+      unlink(index);
+      fire(index);
+    }
+  }
+
+public:
+  inline timer_wheel(clock::duration tick = std::chrono::milliseconds(1), clock::time_point origin = clock::now())
+      : tick(tick)
+      , origin(origin) {
+    for (auto &level : slots) level.fill(npos);
+  }
+
+  timer_wheel(timer_wheel const &) = delete;
+  timer_wheel &operator=(timer_wheel const &) = delete;
+
+  // runs fn once delay has passed, then every period if it is not zero; never early
+  inline handle schedule(clock::duration delay, std::function<void()> fn, clock::duration period = {}) {
+    uint32_t index;
+    if (free_head != npos)
+      index = std::exchange(free_head, entries[free_head].next);
+    else {
+      index = entries.size();
+      entries.emplace_back();
+    }
+    auto &e  = entries[index];
+    e.fn     = std::move(fn);
+    e.expiry = std::max<uint64_t>((clock::now() - origin + delay + tick - clock::duration(1)) / tick, current + 1);
+    e.period = period > clock::duration::zero() ? std::max<uint64_t>((period + tick - clock::duration(1)) / tick, 1) : 0;
+    link(index);
+    count++;
+    return { index, e.generation };
+  }
+
+  // false if the timer already fired or was cancelled
+  inline bool cancel(handle timer) {
+    if (timer.index >= entries.size()) return false;
+    auto &e = entries[timer.index];
+    if (e.generation != timer.generation) return false;
+    if (e.linked) unlink(timer.index);
+    release(timer.index);
+    return true;
+  }
+
+  // runs every timer due at now, skipping straight over empty stretches of the wheel
+  inline void advance(clock::time_point now) {
+    auto target = ticks(now);
+    while (current < target) {
+      current = std::min(target, next_tick());
+      expire();
+    }
+  }
+
+  // when advance() has work next, time_point::max() without timers
+  inline clock::time_point next() const {
+    auto at = next_tick();
+    return at == never ? clock::time_point::max() : origin + tick * static_cast<clock::rep>(at);
+  }
+
+  inline size_t size() const { return count; }
+};
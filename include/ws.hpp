@@ -52,7 +52,7 @@ struct Handshake {
 
 template <typename io = Output> struct Frame {
   FrameType type;
-  uint64_t eaten;
+  uint64_t eaten = 0;
   Data<io> payload;
 
   inline Frame() = default;
@@ -138,7 +138,19 @@ Data<Output> makeHandshakeAnswer(Data<Input> key, Data<Input> protocol = {});
 Data<Input> parseHandshakeAnswer(Data<Input> input, Data<Input> key);
 
 Frame<Output> parseFrame(Data<Input>);
+// Like parseFrame, but unmasks the payload inside input and returns a view of it.
+// The caller must not parse the same bytes again.
+Frame<Input> parseFrameInPlace(char *input, size_t length);
 Frame<Input> parseServerFrame(Data<Input>);
+
+// 2 byte header, 8 byte extended payload length and 4 byte masking key
+constexpr size_t max_frame_header = 14;
+
+// Writes only the frame header (with a fresh masking key if mask is set) into buffer,
+// so the payload can be sent from where it already lives. Returns the header length.
+size_t writeFrameHeader(char *buffer, Frame<Input> const &frame, bool mask = false);
+// XORs data with the 4 byte masking key; applying it twice restores the input
+void applyMask(char *data, size_t length, char const *mask);
 Data<Output> makeFrame(Frame<Input> frame, bool mask = false);
 
 } // namespace ws
\ No newline at end of file
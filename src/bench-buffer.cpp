@@ -0,0 +1,83 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <rpcws.hpp>
+
+// Every read delivers 64 KiB of small pipelined frames; the loop parses and
+// drops them one by one like server_wsio::client::handle does.
+
+using namespace rpcws;
+using bench_clock = std::chrono::steady_clock;
+
+// the receive buffer used before: drop() moved the unread bytes on every frame
+class LegacyBuffer {
+  char *start     = nullptr;
+  char *head      = nullptr;
+  char *allocated = nullptr;
+
+public:
+  char *allocate(size_t size) {
+    if (start) {
+      if (static_cast<size_t>(allocated - head) < size) {
+        auto temp = new char[allocated - start + size];
+        memcpy(temp, start, head - start);
+        head      = temp + (head - start);
+        allocated = temp + (allocated - start) + size;
+        delete[] start;
+        start = temp;
+      }
+    } else {
+      start     = new char[size];
+      head      = start;
+      allocated = start + size;
+    }
+    return head;
+  }
+  void eat(size_t size) { head += size; }
+  void drop(size_t size) {
+    if (!size) return;
+    if (size == static_cast<size_t>(head - start)) {
+      head = start;
+    } else {
+      head -= size;
+      memmove(start, start + size, head - start);
+    }
+  }
+  std::string_view view() const { return { start, static_cast<size_t>(head - start) }; }
+  ~LegacyBuffer() { delete[] start; }
+};
+
+template <typename B> static double run(std::string const &stream, size_t reads, size_t &frames) {
+  B buffer;
+  size_t pos = 0;
+  frames     = 0;
+  auto start = bench_clock::now();
+  for (size_t i = 0; i < reads; i++) {
+    auto size = std::min(stream.size() - pos, size_t(0xFFFF));
+    memcpy(buffer.allocate(0xFFFF), stream.data() + pos, size);
+    buffer.eat(size);
+    pos = (pos + size) % stream.size();
+    while (true) {
+      auto frame = parseServerFrame(buffer.view());
+      if (frame.type == FrameType::INCOMPLETE_FRAME) break;
+      if (frame.type != FrameType::TEXT_FRAME) abort();
+      frames++;
+      buffer.drop(frame.eaten);
+    }
+  }
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main() {
+  for (size_t size : { 16, 64, 256, 1024 }) {
+    // reads of 64 KiB cut through frames, so a partial frame stays behind after every read
+    std::string stream;
+    while (stream.size() < 16 * 0xFFFF) stream += makeFrame({ FrameType::TEXT_FRAME, std::string(size, 'x') });
+    size_t frames;
+    auto legacy      = run<LegacyBuffer>(stream, 16, frames);
+    auto legacy_rate = frames / legacy;
+    auto current     = run<Buffer>(stream, 1024, frames);
+    std::cout << "payload " << size << ": legacy " << (size_t)legacy_rate << " frames/s, Buffer " << (size_t)(frames / current) << " frames/s"
+              << std::endl;
+  }
+}
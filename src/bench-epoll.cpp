@@ -0,0 +1,66 @@
+#include <chrono>
+#include <epoll.hpp>
+#include <iostream>
+#include <map>
+
+// Every fd is an eventfd that is never drained, so each epoll_wait reports
+// min(fds, maxevents) ready descriptors and the loop cost is pure dispatch.
+
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr auto duration = std::chrono::seconds(1);
+static constexpr int fds       = 4096;
+
+static std::vector<int> make_fds() {
+  std::vector<int> ret;
+  for (int i = 0; i < fds; i++) {
+    int fd = eventfd(1, EFD_CLOEXEC);
+    if (fd == -1) throw epoll_exception("eventfd");
+    ret.push_back(fd);
+  }
+  return ret;
+}
+
+static double legacy(std::vector<int> const &list) {
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  std::map<int, size_t> type_map;
+  std::vector<std::function<void(epoll_event const &)>> callbacks;
+  size_t count = 0;
+  callbacks.emplace_back([&](auto) { count++; });
+  for (auto fd : list) {
+    epoll_event event = { .events = EPOLLIN, .data = { .fd = fd } };
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &event);
+    type_map[fd] = 0;
+  }
+  auto start = bench_clock::now();
+  while (bench_clock::now() - start < duration) {
+    for (int i = 0; i < 1024; i++) {
+      epoll_event event = {};
+      auto ret          = epoll_wait(ep, &event, 1, -1);
+      if (ret > 0) callbacks[type_map[event.data.fd]](event);
+    }
+  }
+  close(ep);
+  return count / std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static double batched(std::vector<int> const &list, size_t batch) {
+  epoll ep{ batch };
+  size_t count = 0;
+  auto start   = bench_clock::now();
+  auto type    = ep.reg([&](auto) {
+    if (++count % 4096 == 0 && bench_clock::now() - start >= duration) ep.shutdown();
+  });
+  for (auto fd : list) ep.add(EPOLLIN, fd, type);
+  ep.wait();
+  return count / std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main() {
+  auto list = make_fds();
+  std::cout << "fds: " << fds << std::endl;
+  std::cout << "legacy (maxevents=1, std::map): " << (size_t)legacy(list) << " events/s" << std::endl;
+  for (size_t batch : { 1, 16, 64, 256, 1024 })
+    std::cout << "batched (maxevents=" << batch << "): " << (size_t)batched(list, batch) << " events/s" << std::endl;
+  for (auto fd : list) close(fd);
+}
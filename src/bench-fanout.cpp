@@ -0,0 +1,83 @@
+#include <chrono>
+#include <iostream>
+#include <rpcws.hpp>
+#include <sys/socket.h>
+
+// Sends one notification to every subscriber, either framing it per client
+// or queueing a frame prepared once. Draining peers read everything between
+// rounds; backed up peers never read, so every send ends up queued.
+
+using namespace rpcws;
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr size_t subscribers = 1000;
+
+struct fanout {
+  std::vector<std::shared_ptr<server_wsio::client>> clients;
+  std::vector<int> peers;
+
+  fanout(std::shared_ptr<epoll> ep, std::shared_ptr<BufferPool> pool, size_t type, bool backed_up) {
+    static char junk[1 << 16];
+    for (size_t i = 0; i < subscribers; i++) {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0) throw std::runtime_error("socketpair");
+      if (backed_up)
+        while (write(fds[0], junk, sizeof junk) > 0) {}
+      clients.emplace_back(std::make_shared<server_wsio::client>(fds[0], "/", ep, pool));
+      ep->add(EPOLLIN, fds[0], type);
+      peers.emplace_back(fds[1]);
+    }
+  }
+  void drain() {
+    static char sink[1 << 16];
+    for (auto fd : peers)
+      while (read(fd, sink, sizeof sink) > 0) {}
+  }
+  ~fanout() {
+    for (auto &client : clients) client->shutdown();
+    for (auto fd : peers) close(fd);
+  }
+};
+
+template <typename F> static double timed(F fn) {
+  auto start = bench_clock::now();
+  fn();
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main() {
+  auto ep   = std::make_shared<epoll>();
+  auto pool = std::make_shared<BufferPool>();
+  auto type = ep->reg([](epoll_event const &) {});
+  server_wsio server("ws://127.0.0.1:16410/", ep);
+
+  for (bool backed_up : { false, true }) {
+    size_t rounds = backed_up ? 10 : 100;
+    for (size_t size : { 64, 1024, 16384 }) {
+      std::string payload(size, 'x');
+      double each = 0, once = 0;
+      {
+        fanout subs(ep, pool, type, backed_up);
+        for (size_t r = 0; r < rounds; r++) {
+          each += timed([&] {
+            for (auto &client : subs.clients) client->send(payload, message_type::TEXT);
+          });
+          if (!backed_up) subs.drain();
+        }
+      }
+      {
+        fanout subs(ep, pool, type, backed_up);
+        for (size_t r = 0; r < rounds; r++) {
+          once += timed([&] {
+            auto msg = server.prepare(payload);
+            for (auto &client : subs.clients) client->send(msg);
+          });
+          if (!backed_up) subs.drain();
+        }
+      }
+      std::cout << (backed_up ? "backed up" : "draining") << ", payload " << size << ": framed per client "
+                << (size_t)(subscribers * rounds / each) << " sends/s, prepared once " << (size_t)(subscribers * rounds / once) << " sends/s"
+                << std::endl;
+    }
+  }
+}
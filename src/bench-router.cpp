@@ -0,0 +1,41 @@
+#include <chrono>
+#include <iostream>
+#include <rpc.hpp>
+
+// Dispatches requests for the last of N "service<i>.*" routes, registered
+// once as plain std::regex (linear scan) and once as route (prefix trie).
+
+using namespace rpc;
+using bench_clock = std::chrono::steady_clock;
+
+struct null_io : server_io {
+  struct null_client : client {
+    void shutdown() override {}
+    void send(std::string_view, message_type) override {}
+  };
+  recv_fn recv;
+
+  void shutdown() override {}
+  void accept(accept_fn, remove_fn, recv_fn fn) override { recv = fn; }
+};
+
+template <typename R> static double run(size_t routes, size_t requests) {
+  auto io = new null_io;
+  RPC instance{ std::unique_ptr<server_io>(io) };
+  for (size_t i = 0; i < routes; i++)
+    instance.reg(R("^service" + std::to_string(i) + "\\.(\\S+)$"), [](auto, auto, json) -> json { return nullptr; });
+  instance.start();
+  auto client = std::make_shared<null_io::null_client>();
+  auto req    = R"({"jsonrpc":"2.0","method":"service)" + std::to_string(routes - 1) + R"(.call","params":[],"id":1})";
+  auto start  = bench_clock::now();
+  for (size_t i = 0; i < requests; i++) io->recv(client, req, message_type::TEXT);
+  return requests / std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main() {
+  for (size_t routes : { 10, 100, 1000 }) {
+    auto requests = 200000 / routes;
+    std::cout << routes << " routes: linear " << (size_t)run<std::regex>(routes, requests) << " req/s, trie " << (size_t)run<route>(routes, requests)
+              << " req/s" << std::endl;
+  }
+}
@@ -0,0 +1,64 @@
+#include <chrono>
+#include <iostream>
+#include <openssl/ssl.h>
+#include <rpcws.hpp>
+#include <thread>
+
+// Opens TLS connections one after another until the upgrade is answered, either with a
+// fresh client context each time, so every handshake is a full one, or with one shared
+// context that resumes the session the server handed out on the previous connection.
+
+using namespace rpcws;
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr auto duration = std::chrono::seconds(1);
+static constexpr auto address  = "wss://127.0.0.1:16420/";
+
+static void connect(std::shared_ptr<ssl_context> ctx) {
+  auto ep = std::make_shared<epoll>();
+  RPC::Client client(std::make_unique<client_wsio>(std::move(ctx), address, ep));
+  client.start().then([&] { ep->shutdown(); }).fail([&](auto) { ep->shutdown(); });
+  ep->wait();
+  client.stop();
+}
+
+template <typename F> static double rate(F make) {
+  size_t count = 0;
+  auto start   = bench_clock::now();
+  while (bench_clock::now() - start < duration) {
+    connect(make());
+    count++;
+  }
+  return count / std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+  OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+  auto cert = argc > 2 ? argv[1] : "./cert.pem";
+  auto priv = argc > 2 ? argv[2] : "./priv.key";
+
+  try {
+    auto ep     = std::make_shared<epoll>();
+    auto sslctx = std::make_shared<ssl_context>(cert, priv);
+    RPC server{ std::make_unique<server_wsio>(sslctx, address, ep) };
+    server.start();
+    std::thread loop([&] { ep->wait(); });
+
+    auto full = rate([] { return std::make_shared<ssl_context>(); });
+    auto hits = SSL_CTX_sess_hits(sslctx->ctx);
+
+    auto shared  = std::make_shared<ssl_context>();
+    auto resumed = rate([&] { return shared; });
+    hits         = SSL_CTX_sess_hits(sslctx->ctx) - hits;
+
+    std::cout << "full handshake: " << (size_t)full << " connections/s" << std::endl;
+    std::cout << "resumed session: " << (size_t)resumed << " connections/s (" << hits << " resumed)" << std::endl;
+
+    ep->post([&] { server.stop(); });
+    ep->shutdown();
+    loop.join();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
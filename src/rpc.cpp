@@ -1,12 +1,94 @@
+#include <algorithm>
+#include <cstring>
 #include <exception>
 #include <iostream>
 #include <rpc.hpp>
+#include <tuple>
+#include <type_traits>
 
 namespace rpc {
 
+route::route(std::string source, std::regex::flag_type flags)
+    : source(std::move(source))
+    , regex(this->source, flags) {
+  // prefix() reads ECMAScript escapes, which extended shares; basic, grep and awk give \( or \{ other meanings
+  auto grammar = flags & (std::regex::basic | std::regex::extended | std::regex::awk | std::regex::grep | std::regex::egrep);
+  if ((flags & std::regex::icase) || (grammar && grammar != std::regex::extended)) this->source.clear();
+}
+
+std::string route::prefix() const {
+  std::string ret;
+  if (source.find('|') != std::string::npos) return ret;
+  size_t i = source[0] == '^' ? 1 : 0;
+  while (i < source.size()) {
+    auto c = source[i];
+    if (c == '\\' && i + 1 < source.size() && !isalnum(static_cast<unsigned char>(source[i + 1]))) {
+      c = source[i + 1];
+      i += 2;
+    } else if (strchr(".[](){}*+?^$\\", c)) {
+      break;
+    } else {
+      i++;
+    }
+    // an optional or repeated character is not part of every match
+    if (i < source.size() && strchr("*?{", source[i])) break;
+    ret.push_back(c);
+  }
+  return ret;
+}
+
+void RPC::trie::insert(std::string_view prefix, size_t route) {
+  size_t current = 0;
+  for (auto c : prefix) {
+    auto it = nodes[current].children.find(c);
+    if (it == nodes[current].children.end()) {
+      nodes.emplace_back();
+      it = nodes[current].children.emplace(c, nodes.size() - 1).first;
+    }
+    current = it->second;
+  }
+  nodes[current].routes.emplace_back(route);
+}
+
+void RPC::trie::candidates(std::string_view name, std::vector<size_t> &out) const {
+  size_t current = 0;
+  for (size_t i = 0;; i++) {
+    auto &routes = nodes[current].routes;
+    out.insert(out.end(), routes.begin(), routes.end());
+    if (i == name.size()) break;
+    auto it = nodes[current].children.find(name[i]);
+    if (it == nodes[current].children.end()) break;
+    current = it->second;
+  }
+  std::sort(out.begin(), out.end());
+}
+
+static std::string encode(json const &msg, codec format) {
+  std::string out;
+  switch (format) {
+  case codec::JSON: return msg.dump();
+  case codec::CBOR: json::to_cbor(msg, out); break;
+  case codec::MSGPACK: json::to_msgpack(msg, out); break;
+  }
+  return out;
+}
+
+static json decode(std::string_view data, codec format) {
+  switch (format) {
+  case codec::CBOR: return json::from_cbor(data.begin(), data.end());
+  case codec::MSGPACK: return json::from_msgpack(data.begin(), data.end());
+  default: return json::parse(data);
+  }
+}
+
+static void send(server_io::client &client, json const &msg, codec format) {
+  client.send(encode(msg, format), format == codec::JSON ? message_type::TEXT : message_type::BINARY);
+}
+
 RPC::RPC(decltype(io) &&io, callback_ref_t handler)
     : io(std::move(io))
     , callback_ref(handler) {
+  this->io->protocols({ cbor_protocol, msgpack_protocol });
   reg("rpc.on", [this](std::shared_ptr<server_io::client> client, json input) -> json {
     if (input.is_array()) {
       std::map<std::string, std::string> lists;
@@ -16,10 +98,10 @@ RPC::RPC(decltype(io) &&io, callback_ref_t handler)
         } else
           throw InvalidParams{};
       }
+      std::lock_guard guard{ mtx };
       for (auto &[k, v] : lists) {
-        auto it = std::find(server_events.begin(), server_events.end(), k);
-        if (it != server_events.end()) {
-          server_event_map[k].emplace(client);
+        if (auto it = server_events.find(k); it != server_events.end()) {
+          it->second.add(client);
           v = "ok";
         }
       }
@@ -36,227 +118,742 @@ RPC::RPC(decltype(io) &&io, callback_ref_t handler)
         } else
           throw InvalidParams{};
       }
+      std::lock_guard guard{ mtx };
       for (auto &[k, v] : lists) {
-        auto it = std::find(server_events.begin(), server_events.end(), k);
-        if (it != server_events.end()) {
-          if (server_event_map[k].erase(client) == 0)
-            v = "not subscribed";
-          else
+        if (auto it = server_events.find(k); it != server_events.end()) {
+          if (it->second.remove(client.get()))
             v = "ok";
+          else
+            v = "not subscribed";
         }
       }
       return lists;
     } else
       throw InvalidParams{};
   });
+  // ids of requests the client no longer waits for, each answered with whether it was still running
+  reg("rpc.cancel", [this](std::shared_ptr<server_io::client> client, json input) -> json {
+    if (!input.is_array()) throw InvalidParams{};
+    auto ret = json::array();
+    for (auto &id : input) ret.push_back(!id.is_null() && cancel(client.get(), id));
+    return ret;
+  });
 }
 
 RPC::~RPC() {}
 
+void RPC::topic::add(client_handler const &client) {
+  if (position.emplace(client.get(), clients.size()).second) clients.push_back({ client, codec_for(client->protocol()) });
+}
+
+bool RPC::topic::remove(server_io::client *client) {
+  auto it = position.find(client);
+  if (it == position.end()) return false;
+  // swap with the last subscriber so the list stays dense
+  auto idx = it->second;
+  position.erase(it);
+  if (idx != clients.size() - 1) {
+    clients[idx]                        = std::move(clients.back());
+    position[clients[idx].client.get()] = idx;
+  }
+  clients.pop_back();
+  return true;
+}
+
 void RPC::event(std::string_view name) {
   std::lock_guard guard{ mtx };
-  server_events.emplace_back(name);
+  server_events.try_emplace(std::string{ name });
 }
 
 void RPC::emit(std::string const &name, json data) {
-  auto obj = json::object({ { "notification", name }, { "params", data } }).dump();
+  auto obj = json::object({ { "notification", name }, { "params", data } });
+  // one prepared message per codec in use
+  std::shared_ptr<server_io::prepared const> prepared[3];
+  // sends only queue the shared message and never block, so the subscribers are walked in place
   std::lock_guard guard{ mtx };
-  auto it = server_event_map.find(name);
-  if (it != server_event_map.end()) {
-    auto set = it->second;
-    auto p   = set.begin();
-    auto end = set.end();
-    while (p != end) {
-      auto ptr = p->lock();
-      if (ptr) {
-        ptr->send(obj);
-        ++p;
-      } else {
-        set.erase(p++);
-      }
+  if (auto it = server_events.find(name); it != server_events.end())
+    for (auto &[client, format] : it->second.clients) {
+      auto &msg = prepared[static_cast<size_t>(format)];
+      if (!msg) msg = io->prepare(encode(obj, format), format == codec::JSON ? message_type::TEXT : message_type::BINARY);
+      client->send(msg);
     }
-  }
 }
 
-void RPC::reg(std::string_view name, maybe_async_handler cb) {
+void RPC::update(std::function<void(registry &)> fn) {
   std::lock_guard guard{ mtx };
-  methods.emplace(name, cb);
+  auto next = std::make_shared<registry>(*std::atomic_load(&table));
+  fn(*next);
+  next->methods.clear();
+  for (auto &[k, v] : next->names) next->methods.emplace(k, &v);
+  next->router = {};
+  for (size_t i = 0; i < next->proxied_methods.size(); i++) next->router.insert(next->proxied_methods[i].prefix, i);
+  std::atomic_store(&table, std::shared_ptr<registry const>(std::move(next)));
 }
 
-size_t RPC::reg(std::regex rgx, maybe_async_proxy_handler cb) {
-  std::lock_guard guard{ mtx };
-  proxied_methods.emplace_back(rgx, cb, unqid++);
-  return unqid - 1;
+void RPC::reg(std::string_view name, maybe_async_handler cb, std::shared_ptr<thread_pool> pool) {
+  update([&](registry &next) { next.names.emplace(name, method{ cb, pool }); });
+}
+
+size_t RPC::reg(std::regex rgx, maybe_async_proxy_handler cb, std::shared_ptr<thread_pool> pool) {
+  size_t uid;
+  update([&](registry &next) { next.proxied_methods.push_back({ {}, rgx, cb, pool, uid = unqid++ }); });
+  return uid;
+}
+
+size_t RPC::reg(route rt, maybe_async_proxy_handler cb, std::shared_ptr<thread_pool> pool) {
+  size_t uid;
+  update([&](registry &next) { next.proxied_methods.push_back({ rt.prefix(), rt.regex, cb, pool, uid = unqid++ }); });
+  return uid;
 }
 
 void RPC::unreg(std::string const &name) {
-  std::lock_guard guard{ mtx };
-  methods.erase(name);
+  update([&](registry &next) { next.names.erase(name); });
 }
 
 void RPC::unreg(size_t uid) {
+  update([&](registry &next) {
+    auto &list = next.proxied_methods;
+    list.erase(std::remove_if(list.begin(), list.end(), [&](auto const &x) { return x.uid == uid; }), list.end());
+  });
+}
+
+void RPC::deadline(std::chrono::milliseconds value) {
+  std::lock_guard guard{ running_mtx };
+  request_deadline = value;
+}
+
+std::shared_ptr<thread_pool> RPC::workers() {
   std::lock_guard guard{ mtx };
-  proxied_methods.erase(std::remove_if(proxied_methods.begin(), proxied_methods.end(), [&](auto x) { return std::get<2>(x) == uid; }),
-                        proxied_methods.end());
+  if (!shared_pool) shared_pool = std::make_shared<thread_pool>();
+  return shared_pool;
 }
 
 void RPC::start() {
-  io->accept([this](auto client) { callback_ref->on_accept(client); }, [this](auto client) { callback_ref->on_remove(client); },
+  io->accept([this](auto client) { callback_ref->on_accept(client); },
+             [this](auto client) {
+               {
+                 std::lock_guard guard{ mtx };
+                 for (auto &[_, topic] : server_events) topic.remove(client.get());
+               }
+               abandon(client.get());
+               callback_ref->on_remove(client);
+             },
              [this](auto... x) { incoming(x...); });
 }
 
-void RPC::stop() { io->shutdown(); }
+void RPC::stop() {
+  io->shutdown();
+  // shut down clients are not reported removed
+  {
+    std::lock_guard guard{ mtx };
+    for (auto &[_, topic] : server_events) topic = {};
+  }
+  decltype(inflight) left;
+  {
+    std::lock_guard guard{ running_mtx };
+    left.swap(inflight);
+  }
+  for (auto &[_, list] : left)
+    for (auto &entry : list) entry.ctx->cancel();
+}
 
 struct Invalid : std::runtime_error {
   Invalid(char const *msg)
       : runtime_error(msg) {}
 };
 
-static inline void handle_exception(std::exception_ptr ep, std::recursive_mutex &mtx, std::shared_ptr<server_io::client> client, bool has_id,
-                                    json id) {
+static json error_reply(json error, json const &id = nullptr) {
+  return json::object({ { "jsonrpc", "2.0" }, { "error", std::move(error) }, { "id", id } });
+}
+
+static json error_reply(int code, char const *message, json const &id = nullptr) {
+  return error_reply(json::object({ { "code", code }, { "message", message } }), id);
+}
+
+// the response for a handler that threw or rejected
+static json handler_error(std::exception_ptr ep, json const &id) {
   try {
     if (ep) std::rethrow_exception(ep);
-  } catch (InvalidParams const &e) {
-    std::lock_guard guard{ mtx };
-    auto err = json::object({ { "code", -32602 }, { "message", e.what() } });
-    auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", err }, { "id", nullptr } });
-    if (has_id) ret["id"] = id;
-    client->send(ret.dump());
+  } catch (InvalidParams const &e) { return error_reply(-32602, e.what(), id); } catch (Cancelled const &e) {
+    return error_reply(-32800, e.what(), id);
   } catch (RemoteException const &e) {
-    auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", e.full }, { "id", nullptr } });
-    if (has_id) ret["id"] = id;
-    client->send(ret.dump());
+    return error_reply(e.full, id);
   } catch (json::parse_error const &e) {
-    auto err = json::object({ { "code", -32000 }, { "message", e.what() }, { "data", json::object({ { "position", e.byte } }) } });
-    auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", err }, { "id", nullptr } });
-    if (has_id) ret["id"] = id;
-    client->send(ret.dump());
-  } catch (std::exception const &e) {
-    auto err = json::object({ { "code", -32000 }, { "message", e.what() } });
-    auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", err }, { "id", nullptr } });
-    if (has_id) ret["id"] = id;
-    client->send(ret.dump());
+    return error_reply(json::object({ { "code", -32000 }, { "message", e.what() }, { "data", json::object({ { "position", e.byte } }) } }), id);
+  } catch (std::exception const &e) { return error_reply(-32000, e.what(), id); } catch (...) {
+    return error_reply(-32000, "Unknown error", id);
+  }
+  return error_reply(-32000, "Unknown error", id);
+}
+
+struct Malformed : std::runtime_error {
+  Malformed(char const *msg)
+      : runtime_error(msg) {}
+};
+
+// Top level members of a request, kept as raw slices of the input.
+// Nested values are only bracket matched here, json::parse validates them once they are used.
+struct Envelope {
+  std::string_view jsonrpc, method, params, id;
+
+  static Envelope scan(std::string_view input);
+  // raw entries of a batch
+  static std::vector<std::string_view> split(std::string_view input);
+
+private:
+  std::string_view input;
+  size_t pos = 0;
+
+  void finish();
+
+  // JSON whitespace; NUL is none, so strchr cannot be used to test it
+  static bool space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+  char peek();
+  void expect(char c);
+  std::string_view string();
+  std::string_view value();
+};
+
+char Envelope::peek() {
+  while (pos < input.size() && space(input[pos])) pos++;
+  if (pos >= input.size()) throw Malformed{ "unexpected end of input" };
+  return input[pos];
+}
+
+void Envelope::expect(char c) {
+  if (peek() != c) throw Malformed{ "unexpected character" };
+  pos++;
+}
+
+std::string_view Envelope::string() {
+  auto begin = pos++;
+  while (true) {
+    if (pos >= input.size()) throw Malformed{ "unterminated string" };
+    auto c = input[pos++];
+    if (c == '"') break;
+    if (c == '\\')
+      pos++;
+    else if (static_cast<unsigned char>(c) < 0x20)
+      throw Malformed{ "control character in string" };
+  }
+  return input.substr(begin, pos - begin);
+}
+
+std::string_view Envelope::value() {
+  auto c     = peek();
+  auto begin = pos;
+  if (c == '"') return string();
+  if (c == '{' || c == '[') {
+    std::string closers;
+    while (true) {
+      if (pos >= input.size()) throw Malformed{ "unexpected end of input" };
+      c = input[pos];
+      if (c == '"') {
+        string();
+        continue;
+      }
+      pos++;
+      if (c == '{')
+        closers.push_back('}');
+      else if (c == '[')
+        closers.push_back(']');
+      else if (c == '}' || c == ']') {
+        if (closers.back() != c) throw Malformed{ "mismatched bracket" };
+        closers.pop_back();
+        if (closers.empty()) break;
+      }
+    }
+  } else {
+    for (; pos < input.size() && input[pos] != ',' && input[pos] != '}' && input[pos] != ']' && !space(input[pos]); pos++)
+      // json::parse would stop at a NUL and take what came before it
+      if (static_cast<unsigned char>(input[pos]) < 0x20) throw Malformed{ "control character in value" };
+    if (pos == begin) throw Malformed{ "value expected" };
   }
+  return input.substr(begin, pos - begin);
 }
 
-template <class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
-template <class... Ts> overloaded(Ts...)->overloaded<Ts...>;
+Envelope Envelope::scan(std::string_view input) {
+  Envelope ret;
+  ret.input = input;
+  if (ret.peek() != '{') {
+    // rare path, keep the exact parse error for malformed input
+    (void)json::parse(input);
+    throw Invalid{ "object required" };
+  }
+  ret.pos++;
+  if (ret.peek() == '}')
+    ret.pos++;
+  else
+    while (true) {
+      if (ret.peek() != '"') throw Malformed{ "member name expected" };
+      auto key = ret.string();
+      ret.expect(':');
+      auto val = ret.value();
+      std::string decoded;
+      if (key.find('\\') != std::string_view::npos) {
+        decoded = json(json::parse(key).get<std::string>()).dump();
+        key     = decoded;
+      }
+      if (key == "\"jsonrpc\"")
+        ret.jsonrpc = val;
+      else if (key == "\"method\"")
+        ret.method = val;
+      else if (key == "\"params\"")
+        ret.params = val;
+      else if (key == "\"id\"")
+        ret.id = val;
+      if (ret.peek() == ',') {
+        ret.pos++;
+        continue;
+      }
+      ret.expect('}');
+      break;
+    }
+  ret.finish();
+  return ret;
+}
+
+std::vector<std::string_view> Envelope::split(std::string_view input) {
+  Envelope ret;
+  std::vector<std::string_view> entries;
+  ret.input = input;
+  ret.expect('[');
+  if (ret.peek() == ']')
+    ret.pos++;
+  else
+    while (true) {
+      entries.emplace_back(ret.value());
+      if (ret.peek() == ',') {
+        ret.pos++;
+        continue;
+      }
+      ret.expect(']');
+      break;
+    }
+  ret.finish();
+  return entries;
+}
+
+void Envelope::finish() {
+  while (pos < input.size() && space(input[pos])) pos++;
+  if (pos != input.size()) throw Malformed{ "trailing characters" };
+}
+
+// raw is a slice returned by Envelope, escapes are rare enough to go through json
+static std::string unquote(std::string_view raw) {
+  if (raw.find('\\') == std::string_view::npos) return std::string{ raw.substr(1, raw.size() - 2) };
+  return json::parse(raw).get<std::string>();
+}
+
+// whether a registered handler wants the request context as its last argument
+template <typename F> struct context_arg : std::false_type {};
+template <typename R, typename... Args>
+struct context_arg<std::function<R(Args...)>> : std::is_same<std::tuple_element_t<sizeof...(Args) - 1, std::tuple<Args...>>, RPC::context_ref> {};
+template <typename F> static constexpr bool takes_context = context_arg<std::decay_t<F>>::value;
+
+// maps what goes wrong before a handler runs to JSON-RPC errors
+template <typename F> static void guarded(std::function<void(json)> const &reply, F fn) {
+  try {
+    fn();
+  } catch (json::parse_error const &e) { reply(error_reply(-32700, e.what())); } catch (Malformed const &e) {
+    reply(error_reply(-32700, e.what()));
+  } catch (Invalid const &e) { reply(error_reply(-32600, e.what())); } catch (...) {
+    reply(error_reply(-32000, "Unknown error"));
+  }
+}
+
+// one reply shared by every entry of a batch, the array goes out once all of them, async ones included, have answered
+static std::function<void(json)> collect(std::shared_ptr<server_io::client> client, size_t count, codec format) {
+  struct collector {
+    std::mutex mtx;
+    json responses = json::array();
+    size_t left;
+  };
+  auto state  = std::make_shared<collector>();
+  state->left = count;
+  return [client, state, format](json ret) {
+    std::lock_guard guard{ state->mtx };
+    if (!ret.is_null()) state->responses.emplace_back(std::move(ret));
+    if (--state->left == 0 && !state->responses.empty()) send(*client, state->responses, format);
+  };
+}
 
 void RPC::incoming(std::shared_ptr<server_io::client> client, std::string_view data, message_type type) {
+  auto format = type == message_type::BINARY ? codec_for(client->protocol()) : codec::JSON;
+  auto single = [client, format](json ret) {
+    if (!ret.is_null()) send(*client, ret, format);
+  };
+  if (type == message_type::BINARY && format == codec::JSON) {
+    try {
+      return callback_ref->on_binary(client, data);
+    } catch (...) { return single(error_reply(-32000, "Unknown error")); }
+  }
+
+  if (format != codec::JSON) {
+    json parsed;
+    try {
+      parsed = decode(data, format);
+    } catch (json::parse_error const &e) { return single(error_reply(-32700, e.what())); }
+    if (!parsed.is_array()) return dispatch(client, std::move(parsed), single);
+    if (parsed.empty()) return single(error_reply(-32600, "empty batch"));
+    auto reply = collect(client, parsed.size(), format);
+    for (auto &entry : parsed) dispatch(client, std::move(entry), reply);
+    return;
+  }
+
+  if (auto first = data.find_first_not_of(" \t\n\r"); first == std::string_view::npos || data[first] != '[') return dispatch(client, data, single);
+  std::vector<std::string_view> entries;
   try {
-    if (type == message_type::BINARY) return callback_ref->on_binary(client, data);
-    auto parsed = json::parse(data);
-    if (!parsed.is_object()) throw Invalid{ "object required" };
-    if (parsed["jsonrpc"] != "2.0") throw Invalid{ "jsonrpc version mismatch" };
-    auto method_ = parsed["method"];
-    auto params  = parsed["params"];
-    auto has_id  = parsed.contains("id");
-    auto id      = parsed["id"];
-    if (!method_.is_string()) throw Invalid{ "method need to be a string" };
-    if (!params.is_structured()) throw Invalid{ "params need to be a object or array" };
+    entries = Envelope::split(data);
+  } catch (Malformed const &e) { return single(error_reply(-32700, e.what())); }
+  if (entries.empty()) return single(error_reply(-32600, "empty batch"));
+  auto reply = collect(client, entries.size(), format);
+  for (auto entry : entries) dispatch(client, entry, reply);
+}
+
+void RPC::dispatch(std::shared_ptr<server_io::client> client, std::string_view data, reply_fn reply) {
+  guarded(reply, [&] {
+    auto envelope = Envelope::scan(data);
+    if (envelope.jsonrpc != "\"2.0\"" && (envelope.jsonrpc.empty() || envelope.jsonrpc[0] != '"' || unquote(envelope.jsonrpc) != "2.0"))
+      throw Invalid{ "jsonrpc version mismatch" };
+    if (envelope.method.empty() || envelope.method[0] != '"') throw Invalid{ "method need to be a string" };
+    if (envelope.params.empty() || (envelope.params[0] != '{' && envelope.params[0] != '['))
+      throw Invalid{ "params need to be a object or array" };
+    auto has_id = !envelope.id.empty();
+    auto id     = has_id ? json::parse(envelope.id) : json{};
     if (has_id && !id.is_primitive()) throw Invalid{ "id need to be a primitive" };
-    auto method = method_.get<std::string>();
+    std::string decoded;
+    std::string_view method = envelope.method.substr(1, envelope.method.size() - 2);
+    if (method.find('\\') != std::string_view::npos) method = decoded = unquote(envelope.method);
+    invoke(client, method, envelope.params, {}, has_id, std::move(id), reply);
+  });
+}
 
-    std::lock_guard guard{ mtx };
-    if (auto it = methods.find(method); it == methods.end()) {
-      bool matched = false;
-      for (auto &[k, v, _] : proxied_methods) {
-        if (std::smatch res; std::regex_match(method, res, k)) {
-          std::visit(overloaded{
-                         [&](std::function<json(std::shared_ptr<server_io::client>, std::smatch, json)> sync) {
-                           try {
-                             auto result = sync(client, res, params);
-                             if (has_id) {
-                               auto ret = json::object({ { "jsonrpc", "2.0" }, { "result", result }, { "id", id } });
-                               client->send(ret.dump());
-                             }
-                           } catch (...) { handle_exception(std::current_exception(), mtx, client, has_id, id); }
-                         },
-                         [&](std::function<promise<json>(std::shared_ptr<server_io::client>, std::smatch, json)> async) {
-                           async(client, res, params)
-                               .then([=](json result) {
-                                 if (has_id) {
-                                   auto ret = json::object({ { "jsonrpc", "2.0" }, { "result", result }, { "id", id } });
-                                   client->send(ret.dump());
-                                 }
-                               })
-                               .fail([=](std::exception_ptr ptr) { handle_exception(ptr, mtx, client, has_id, id); });
-                         },
-                     },
-                     v);
-          matched = true;
-          break;
-        }
+void RPC::dispatch(std::shared_ptr<server_io::client> client, json request, reply_fn reply) {
+  guarded(reply, [&] {
+    if (!request.is_object()) throw Invalid{ "object required" };
+    if (auto it = request.find("jsonrpc"); it == request.end() || *it != "2.0") throw Invalid{ "jsonrpc version mismatch" };
+    auto method = request.find("method");
+    if (method == request.end() || !method->is_string()) throw Invalid{ "method need to be a string" };
+    auto params = request.find("params");
+    if (params == request.end() || !params->is_structured()) throw Invalid{ "params need to be a object or array" };
+    auto id     = request.find("id");
+    auto has_id = id != request.end();
+    if (has_id && !id->is_primitive()) throw Invalid{ "id need to be a primitive" };
+    invoke(client, method->get_ref<std::string const &>(), {}, std::move(*params), has_id, has_id ? std::move(*id) : json{}, reply);
+  });
+}
+
+// params come either as raw text, parsed only when a handler exists, or already decoded
+void RPC::invoke(std::shared_ptr<server_io::client> client, std::string_view method, std::string_view raw_params, json params, bool has_id,
+                 json id, reply_fn reply) {
+  // the snapshot keeps the handlers alive until they have run
+  auto current            = std::atomic_load(&table);
+  RPC::method const *hit  = nullptr;
+  proxied const *matching = nullptr;
+  if (auto it = current->methods.find(method); it != current->methods.end()) {
+    hit = it->second;
+  } else if (!current->proxied_methods.empty()) {
+    std::vector<size_t> candidates;
+    current->router.candidates(method, candidates);
+    std::string name{ method };
+    for (auto i : candidates) {
+      auto &route = current->proxied_methods[i];
+      if (std::regex_match(name, route.regex)) {
+        matching = &route;
+        break;
       }
-      if (!matched) {
-        std::lock_guard guard{ mtx };
-        auto err = json::object({ { "code", -32601 }, { "message", "method not found" } });
-        auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", err }, { "id", nullptr } });
-        if (has_id) ret["id"] = id;
-        client->send(ret.dump());
+    }
+  }
+  if (!hit && !matching) return reply(error_reply(-32601, "method not found", id));
+  if (!raw_params.empty()) params = json::parse(raw_params);
+  auto &pool = matching ? matching->pool : hit->pool;
+
+  // handlers asking for a context are tracked until they answer, so they can be cancelled
+  auto wants = [](auto const &fn) { return takes_context<decltype(fn)>; };
+  std::shared_ptr<context> ctx;
+  server_io::timer_id timer = 0;
+  if (matching ? std::visit(wants, matching->handler) : std::visit(wants, hit->handler)) {
+    std::chrono::milliseconds limit;
+    {
+      std::lock_guard guard{ running_mtx };
+      limit         = request_deadline;
+      auto deadline = limit.count() > 0 ? context::clock::now() + limit : context::clock::time_point::max();
+      ctx           = std::make_shared<context>(has_id ? id : json{}, deadline);
+      inflight[client.get()].push_back({ ctx, reply });
+    }
+    // handlers waiting in on_cancel learn about the deadline from the connection's timer
+    if (limit.count() > 0)
+      timer = client->schedule(limit, [weak = std::weak_ptr<context>(ctx)] {
+        if (auto ctx = weak.lock()) ctx->cancel();
+      });
+  }
+  if (pool) {
+    // a worker may end up with the last reference to the connection, which is let go on its own thread
+    auto target = client.get();
+    client      = { target, [owner = std::move(client)](server_io::client *target) mutable { target->post([owner = std::move(owner)] {}); } };
+    // replies of pooled handlers are written back on the thread that owns the connection
+    reply = [client, reply = std::move(reply)](json ret) { client->post([reply, ret = std::move(ret)] { reply(ret); }); };
+  }
+  // an answer after rpc.cancel or a disconnect is dropped
+  if (ctx)
+    reply = [this, client, ctx, timer, reply = std::move(reply)](json ret) {
+      if (timer) client->cancel(timer);
+      if (untrack(client.get(), *ctx)) reply(std::move(ret));
+    };
+
+  auto call = [current, hit, matching, name = std::string{ method }, client, params = std::move(params), has_id, id, reply, ctx]() mutable {
+    // notifications answer with null, which is never sent
+    auto result = [=](json result) { return has_id ? json::object({ { "jsonrpc", "2.0" }, { "result", result }, { "id", id } }) : json{}; };
+    auto finish = [&](auto produce) {
+      if constexpr (std::is_same_v<decltype(produce()), json>) {
+        json ret;
+        try {
+          ret = result(produce());
+        } catch (...) { ret = handler_error(std::current_exception(), id); }
+        reply(std::move(ret));
+      } else {
+        produce().then([=](json value) { reply(result(value)); }).fail([=](std::exception_ptr ptr) { reply(handler_error(ptr, id)); });
       }
+    };
+    if (matching) {
+      // match results point into name, so they are taken on the thread that runs the handler
+      std::smatch res;
+      std::regex_match(name, res, matching->regex);
+      std::visit(
+          [&](auto const &fn) {
+            if constexpr (takes_context<decltype(fn)>)
+              finish([&] { return fn(client, res, std::move(params), ctx); });
+            else
+              finish([&] { return fn(client, res, std::move(params)); });
+          },
+          matching->handler);
     } else {
-      std::visit(overloaded{
-                     [&](std::function<json(std::shared_ptr<server_io::client>, json)> const &sync) {
-                       try {
-                         auto result = sync(client, params);
-                         if (has_id) {
-                           auto ret = json::object({ { "jsonrpc", "2.0" }, { "result", result }, { "id", id } });
-                           client->send(ret.dump());
-                         }
-                       } catch (...) { handle_exception(std::current_exception(), mtx, client, has_id, id); }
-                     },
-                     [&](std::function<promise<json>(std::shared_ptr<server_io::client>, json)> const &async) {
-                       async(client, params)
-                           .then([=](json result) {
-                             if (has_id) {
-                               auto ret = json::object({ { "jsonrpc", "2.0" }, { "result", result }, { "id", id } });
-                               client->send(ret.dump());
-                             }
-                           })
-                           .fail([=](std::exception_ptr ptr) { handle_exception(ptr, mtx, client, has_id, id); });
-                     },
-                 },
-                 it->second);
+      std::visit(
+          [&](auto const &fn) {
+            if constexpr (takes_context<decltype(fn)>)
+              finish([&] { return fn(client, std::move(params), ctx); });
+            else
+              finish([&] { return fn(client, std::move(params)); });
+          },
+          hit->handler);
     }
-  } catch (json::parse_error const &e) {
-    std::lock_guard guard{ mtx };
-    auto err = json::object({ { "code", -32700 }, { "message", e.what() } });
-    auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", err }, { "id", nullptr } });
-    client->send(ret.dump());
-  } catch (Invalid const &e) {
+  };
+  if (!pool) return call();
+  // workers report failures of async handlers that throw before returning a promise
+  pool->submit([call = std::move(call), reply, id]() mutable {
+    try {
+      call();
+    } catch (...) { reply(handler_error(std::current_exception(), id)); }
+  });
+}
+
+bool RPC::untrack(server_io::client *client, context const &ctx) {
+  std::lock_guard guard{ running_mtx };
+  auto it = inflight.find(client);
+  if (it == inflight.end()) return false;
+  auto &list = it->second;
+  auto pos   = std::find_if(list.begin(), list.end(), [&](auto const &entry) { return entry.ctx.get() == &ctx; });
+  if (pos == list.end()) return false;
+  *pos = std::move(list.back());
+  list.pop_back();
+  if (list.empty()) inflight.erase(it);
+  return true;
+}
+
+// the handler keeps running until it notices, its answer is replaced by the cancellation error
+bool RPC::cancel(server_io::client *client, json const &id) {
+  running found;
+  {
+    std::lock_guard guard{ running_mtx };
+    auto it = inflight.find(client);
+    if (it == inflight.end()) return false;
+    auto &list = it->second;
+    auto pos   = std::find_if(list.begin(), list.end(), [&](auto const &entry) { return entry.ctx->id() == id; });
+    if (pos == list.end()) return false;
+    found = std::move(*pos);
+    *pos  = std::move(list.back());
+    list.pop_back();
+    if (list.empty()) inflight.erase(it);
+  }
+  found.ctx->cancel();
+  found.reply(error_reply(-32800, "request cancelled", id));
+  return true;
+}
+
+// nobody is left to answer, the requests are cancelled without replies
+void RPC::abandon(server_io::client *client) {
+  std::vector<running> list;
+  {
+    std::lock_guard guard{ running_mtx };
+    if (auto it = inflight.find(client); it != inflight.end()) {
+      list = std::move(it->second);
+      inflight.erase(it);
+    }
+  }
+  for (auto &entry : list) entry.ctx->cancel();
+}
+
+RPC::context::context(json id, clock::time_point deadline)
+    : request_id(std::move(id))
+    , due(deadline) {}
+
+bool RPC::context::cancelled() const { return flag.load(std::memory_order_acquire) || clock::now() >= due; }
+
+void RPC::context::on_cancel(std::function<void()> fn) {
+  {
     std::lock_guard guard{ mtx };
-    auto err = json::object({ { "code", -32600 }, { "message", e.what() } });
-    auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", err }, { "id", nullptr } });
-    client->send(ret.dump());
-  } catch (...) {
+    if (!flag.load(std::memory_order_relaxed)) {
+      listeners.emplace_back(std::move(fn));
+      return;
+    }
+  }
+  fn();
+}
+
+void RPC::context::cancel() {
+  std::vector<std::function<void()>> list;
+  {
     std::lock_guard guard{ mtx };
-    auto err = json::object({ { "code", -32000 }, { "message", "Unknown error" } });
-    auto ret = json::object({ { "jsonrpc", "2.0" }, { "error", err }, { "id", nullptr } });
-    client->send(ret.dump());
+    if (flag.exchange(true, std::memory_order_acq_rel)) return;
+    list.swap(listeners);
   }
+  for (auto &fn : list) fn();
 }
 
 RPC::Client::Client(std::unique_ptr<client_io> &&io, callback_ref_t handler)
     : io(std::move(io))
-    , callback_ref(handler) {}
+    , callback_ref(handler) {
+  this->io->ondie([self = std::weak_ptr<Client *>(self)] {
+    if (auto client = self.lock()) (*client)->abandon();
+  });
+}
 
 RPC::Client::~Client() { io->shutdown(); }
 
 promise<json> RPC::Client::call(std::string const &name, json data) {
+  std::chrono::milliseconds timeout;
+  {
+    std::lock_guard guard{ mtx };
+    timeout = default_timeout;
+  }
+  return call(name, std::move(data), timeout);
+}
+
+promise<json> RPC::Client::call(std::string const &name, json data, std::chrono::milliseconds timeout) {
   return { [=](auto resolver) {
-    auto req = json::object({ { "jsonrpc", "2.0" }, { "method", name }, { "params", data }, { "id", last_id } });
+    unsigned id;
     {
       std::lock_guard guard{ mtx };
-      regmap.emplace(last_id++, resolver);
+      id = last_id++;
+      if (!expect(id, name, resolver, timeout)) return;
     }
-    io->send(req.dump());
+    send(json::object({ { "jsonrpc", "2.0" }, { "method", name }, { "params", data }, { "id", id } }));
+  } };
+}
+
+void RPC::Client::timeout(std::chrono::milliseconds value) {
+  std::lock_guard guard{ mtx };
+  default_timeout = value;
+}
+
+bool RPC::Client::expect(unsigned id, std::string const &name, promise<json>::resolver resolver, std::chrono::milliseconds timeout) {
+  std::lock_guard guard{ mtx };
+  if (closed) {
+    resolver.reject(ConnectionClosed{});
+    return false;
+  }
+  client_io::timer_id timer = 0;
+  if (timeout.count() > 0)
+    timer = io->schedule(timeout, [self = std::weak_ptr<Client *>(self), id, name] {
+      if (auto client = self.lock()) (*client)->expire(id, name);
+    });
+  regmap.emplace(id, pending{ resolver, timer });
+  return true;
+}
+
+void RPC::Client::expire(unsigned id, std::string const &name) {
+  std::lock_guard guard{ mtx };
+  if (auto it = regmap.find(id); it != regmap.end()) {
+    auto resolver = std::move(it->second.resolver);
+    regmap.erase(it);
+    resolver.reject(CallTimeout{ name });
+    // lets the server stop working on it
+    if (!closed) notify("rpc.cancel", json::array({ id }));
+  }
+}
+
+void RPC::Client::abandon() {
+  std::map<unsigned, pending> lost;
+  {
+    std::lock_guard guard{ mtx };
+    closed = true;
+    lost.swap(regmap);
+  }
+  for (auto &[id, call] : lost) {
+    if (call.timer) io->cancel(call.timer);
+    call.resolver.reject(ConnectionClosed{});
+  }
+}
+
+void RPC::Client::notify(std::string_view name, json data) { send(json::object({ { "jsonrpc", "2.0" }, { "method", name }, { "params", data } })); }
+
+void RPC::Client::coalesce(size_t max) {
+  std::lock_guard guard{ mtx };
+  coalesce_max = max;
+  if (!max) flush();
+}
+
+void RPC::Client::send(json request) {
+  std::lock_guard guard{ mtx };
+  if (!coalesce_max) return write(request);
+  if (outgoing.empty())
+    io->defer([self = std::weak_ptr<Client *>(self)] {
+      if (auto client = self.lock()) (*client)->flush();
+    });
+  outgoing.emplace_back(std::move(request));
+  if (outgoing.size() >= coalesce_max) flush();
+}
+
+void RPC::Client::flush() {
+  std::lock_guard guard{ mtx };
+  if (outgoing.empty()) return;
+  auto requests = std::exchange(outgoing, json::array());
+  write(requests.size() == 1 ? requests[0] : requests);
+}
+
+// encoded with the codec the server picked, plain JSON until the handshake is done
+void RPC::Client::write(json const &msg) {
+  auto format = codec_for(io->protocol());
+  io->send(encode(msg, format), format == codec::JSON ? message_type::TEXT : message_type::BINARY);
+}
+
+void RPC::Client::batch(std::function<void(Batch &)> fn) {
+  Batch batch{ *this };
+  fn(batch);
+  if (!batch.requests.empty()) write(batch.requests);
+}
+
+RPC::Client::Batch::Batch(Client &client)
+    : client(client) {}
+
+promise<json> RPC::Client::Batch::call(std::string const &name, json data) {
+  unsigned id;
+  {
+    std::lock_guard guard{ client.mtx };
+    // nothing would answer, so the request is left out of the batch
+    if (client.closed) return { [](auto resolver) { resolver.reject(ConnectionClosed{}); } };
+    id = client.last_id++;
+  }
+  requests.emplace_back(json::object({ { "jsonrpc", "2.0" }, { "method", name }, { "params", data }, { "id", id } }));
+  return { [&client = client, id, name](auto resolver) {
+    std::lock_guard guard{ client.mtx };
+    client.expect(id, name, resolver, client.default_timeout);
   } };
 }
 
-void RPC::Client::notify(std::string_view name, json data) {
-  auto req = json::object({ { "jsonrpc", "2.0" }, { "method", name }, { "params", data } });
-  io->send(req.dump());
+void RPC::Client::Batch::notify(std::string_view name, json data) {
+  requests.emplace_back(json::object({ { "jsonrpc", "2.0" }, { "method", name }, { "params", data } }));
 }
 
 promise<bool> RPC::Client::on(std::string_view name, RPC::Client::data_fn list) {
@@ -271,32 +868,13 @@ promise<bool> RPC::Client::off(std::string const &name) {
 
 void RPC::Client::incoming(std::string_view data, message_type type) {
   try {
-    if (type == message_type::BINARY) return callback_ref->on_binary(data);
-    auto parsed = json::parse(data);
-    if (!parsed.is_object()) throw Invalid{ "object required" };
-    if (parsed.contains("notification")) {
-      auto name = parsed["notification"].get<std::string>();
-      std::lock_guard guard{ mtx };
-      if (auto it = event_map.find(name); it != event_map.end()) {
-        auto &[k, fn] = *it;
-        fn(parsed["params"]);
-      }
+    auto format = type == message_type::BINARY ? codec_for(io->protocol()) : codec::JSON;
+    if (type == message_type::BINARY && format == codec::JSON) return callback_ref->on_binary(data);
+    auto parsed = decode(data, format);
+    if (parsed.is_array()) {
+      for (auto &item : parsed) handle(std::move(item));
     } else {
-      if (parsed["jsonrpc"] != "2.0") throw Invalid{ "jsonrpc version mismatch" };
-      auto result = parsed["result"];
-      auto error  = parsed["error"];
-      auto id     = parsed["id"];
-
-      std::lock_guard guard{ mtx };
-      if (auto it = regmap.find(id.get<unsigned>()); it != regmap.end()) {
-        auto &[_, resolver] = *it;
-        if (error.is_object()) {
-          resolver.reject(RemoteException{ error });
-        } else {
-          resolver.resolve(result);
-        }
-        regmap.erase(it);
-      }
+      handle(std::move(parsed));
     }
   } catch (std::exception &e) {
     std::cerr << e.what() << std::endl;
@@ -304,6 +882,38 @@ void RPC::Client::incoming(std::string_view data, message_type type) {
   }
 }
 
+void RPC::Client::handle(json parsed) {
+  if (!parsed.is_object()) throw Invalid{ "object required" };
+  if (parsed.contains("notification")) {
+    auto name = parsed["notification"].get<std::string>();
+    std::lock_guard guard{ mtx };
+    if (auto it = event_map.find(name); it != event_map.end()) {
+      auto &[k, fn] = *it;
+      fn(parsed["params"]);
+    }
+  } else {
+    if (parsed["jsonrpc"] != "2.0") throw Invalid{ "jsonrpc version mismatch" };
+    auto result = parsed["result"];
+    auto error  = parsed["error"];
+    auto id     = parsed["id"];
+    // errors without an id, like a server that does not know rpc.cancel, belong to no call
+    if (!id.is_number_unsigned()) return;
+
+    std::lock_guard guard{ mtx };
+    if (auto it = regmap.find(id.get<unsigned>()); it != regmap.end()) {
+      auto &[_, call] = *it;
+      auto &resolver  = call.resolver;
+      if (call.timer) io->cancel(call.timer);
+      if (error.is_object()) {
+        resolver.reject(RemoteException{ error });
+      } else {
+        resolver.resolve(result);
+      }
+      regmap.erase(it);
+    }
+  }
+}
+
 promise<void> RPC::Client::start() {
   return { [this](auto resolver) { this->io->recv([=](auto... x) { incoming(x...); }, resolver); } };
 }
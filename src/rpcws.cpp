@@ -1,6 +1,8 @@
 #include "rpc.hpp"
 #include "ws.hpp"
+#include <algorithm>
 #include <experimental/random>
+#include <fcntl.h>
 #include <netdb.h>
 #include <rpcws.hpp>
 #include <sstream>
@@ -31,19 +33,85 @@ ssl_context::ssl_context(std::filesystem::path cert, std::filesystem::path priv)
   SSL_CTX_set_ecdh_auto(ctx, true);
   if (SSL_CTX_use_certificate_file(ctx, cert.c_str(), SSL_FILETYPE_PEM) <= 0) throw SSLError{};
   if (SSL_CTX_use_PrivateKey_file(ctx, priv.c_str(), SSL_FILETYPE_PEM) <= 0) throw SSLError{};
+  static unsigned char const sid_ctx[] = "rpcws";
+  SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof sid_ctx - 1);
+  sessions({});
 }
 ssl_context::ssl_context() {
   auto method = TLS_client_method();
   ctx         = SSL_CTX_new(method);
   if (!ctx) throw SSLError{};
+  // sessions are only kept through on_session, TLS 1.3 tickets arrive after the handshake
+  SSL_CTX_set_app_data(ctx, this);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, on_session);
+}
+ssl_context::~ssl_context() {
+  for (auto &[peer, session] : cache) SSL_SESSION_free(session);
+  SSL_CTX_free(ctx);
+}
+void ssl_context::sessions(ssl_sessions config) {
+  SSL_CTX_set_session_cache_mode(ctx, config.cache_size ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+  SSL_CTX_sess_set_cache_size(ctx, config.cache_size);
+  SSL_CTX_set_timeout(ctx, config.timeout.count());
+  if (config.tickets)
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+  else
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+}
+void ssl_context::ktls(bool enable) {
+#ifdef SSL_OP_ENABLE_KTLS
+  if (enable)
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  else
+    SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+  (void)enable;
+#endif
+}
+void ssl_context::resume(ssl_client &client, std::string peer) {
+  std::lock_guard guard{ mtx };
+  if (auto it = cache.find(peer); it != cache.end()) SSL_set_session(client.client, it->second);
+  client.peer = std::move(peer);
+}
+int ssl_context::on_session(SSL *ssl, SSL_SESSION *session) {
+  auto client = static_cast<ssl_client *>(SSL_get_app_data(ssl));
+  auto self   = static_cast<ssl_context *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  if (!client || !self || client->peer.empty()) return 0;
+  std::lock_guard guard{ self->mtx };
+  auto &slot = self->cache[client->peer];
+  if (slot) SSL_SESSION_free(slot);
+  // returning 1 hands our reference of the session over to the cache
+  slot = session;
+  return 1;
 }
-ssl_context::~ssl_context() { SSL_CTX_free(ctx); }
 
 ssl_client::ssl_client(ssl_context const &sslctx, int fd, bool do_connect) {
   client = SSL_new(sslctx.ctx);
+  if (!client) throw SSLError{};
   SSL_set_fd(client, fd);
-  if ((do_connect ? SSL_connect : SSL_accept)(client) < 0) throw SSLError{};
+  SSL_set_app_data(client, this);
+  SSL_set_mode(client, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if (do_connect)
+    SSL_set_connect_state(client);
+  else
+    SSL_set_accept_state(client);
 }
+bool ssl_client::handshake() {
+  auto ret = SSL_do_handshake(client);
+  if (ret == 1) {
+#ifdef SSL_OP_ENABLE_KTLS
+    kernel_send = BIO_get_ktls_send(SSL_get_wbio(client));
+#endif
+    return true;
+  }
+  switch (SSL_get_error(client, ret)) {
+  case SSL_ERROR_WANT_READ: want_write = false; return false;
+  case SSL_ERROR_WANT_WRITE: want_write = true; return false;
+  default: throw SSLError{};
+  }
+}
+bool ssl_client::resumed() const { return SSL_session_reused(client); }
 void ssl_client::shutdown() { SSL_shutdown(client); }
 ssl_client::~ssl_client() {
   shutdown();
@@ -51,56 +119,144 @@ ssl_client::~ssl_client() {
 }
 #endif
 
-Buffer::Buffer() {}
+BufferPool::BufferPool(size_t slab, size_t max_idle)
+    : slab(slab)
+    , max_idle(max_idle) {}
+
+char *BufferPool::acquire(size_t &capacity) {
+  borrowed++;
+  if (capacity > slab) {
+    created++;
+    return new char[capacity];
+  }
+  capacity = slab;
+  if (idle.empty()) {
+    created++;
+    return new char[slab];
+  }
+  reused++;
+  auto ret = idle.back();
+  idle.pop_back();
+  return ret;
+}
+
+void BufferPool::release(char *data, size_t capacity) {
+  borrowed--;
+  if (capacity == slab && idle.size() < max_idle)
+    idle.push_back(data);
+  else
+    delete[] data;
+}
+
+BufferPool::stats BufferPool::statistics() const { return { slab, idle.size(), borrowed, created, reused }; }
+
+BufferPool::~BufferPool() {
+  for (auto data : idle) delete[] data;
+}
+
+Buffer::Buffer(size_t limit)
+    : limit(limit) {}
+
+Buffer::Buffer(std::shared_ptr<BufferPool> pool, size_t limit)
+    : pool(std::move(pool))
+    , limit(limit) {}
 
 char *Buffer::allocate(size_t size) {
-  if (start) {
-    if (static_cast<size_t>(allocated - head) < size) {
-      auto temp       = new char[allocated - start + size];
-      auto nstart     = temp;
-      auto nend       = temp + (head - start);
-      auto nallocated = temp + (allocated - start) + size;
-      delete[] start;
-      start     = nstart;
-      head      = nend;
-      allocated = nallocated;
-    }
-  } else {
-    start     = new char[size];
-    head      = start;
-    allocated = start + size;
+  if (static_cast<size_t>(allocated - tail) >= size) return tail;
+  auto len = length();
+  if (len > limit) throw BufferOverflow();
+  if (head != start) {
+    memmove(start, head, len);
+    head = start;
+    tail = start + len;
+    if (static_cast<size_t>(allocated - tail) >= size) return tail;
   }
-  return head;
+  auto capacity = std::max(static_cast<size_t>(allocated - start) * 2, len + size);
+  auto temp     = pool ? pool->acquire(capacity) : new char[capacity];
+  if (len) memcpy(temp, head, len);
+  reset();
+  start     = temp;
+  head      = temp;
+  tail      = temp + len;
+  allocated = temp + capacity;
+  return tail;
 }
 
-void Buffer::eat(size_t size) { head += size; }
+size_t Buffer::space() const { return allocated - tail; }
+
+void Buffer::eat(size_t size) { tail += size; }
 
 void Buffer::drop(size_t size) {
-  if (!size) return;
-  if (size == static_cast<size_t>(head - start)) {
-    head = start;
-  } else {
-    head -= size;
-    memmove(start, start + size, head - start);
+  head += size;
+  if (head == tail) {
+    head = tail = start;
+    release();
   }
 }
 
+void Buffer::release() {
+  if (pool && head == tail) reset();
+}
+
 void Buffer::reset() {
-  delete[] start;
-  start = head = allocated = nullptr;
+  if (pool && start)
+    pool->release(start, allocated - start);
+  else
+    delete[] start;
+  start = head = tail = allocated = nullptr;
 }
 
-char *Buffer::begin() const { return start; }
+char *Buffer::begin() const { return head; }
 
-char *Buffer::end() const { return head; }
+char *Buffer::end() const { return tail; }
 
-size_t Buffer::length() const { return head - start; }
+size_t Buffer::length() const { return tail - head; }
 
-std::string_view Buffer::view() const { return { start, length() }; }
+std::string_view Buffer::view() const { return { head, length() }; }
 
 Buffer::operator std::string_view() const { return view(); }
 
-Buffer::~Buffer() { delete[] start; }
+Buffer::~Buffer() { reset(); }
+
+void WriteQueue::push(std::string_view data) {
+  if (data.empty()) return;
+  chunks.push_back({ std::string{ data }, {}, {} });
+  queued += data.size();
+}
+
+void WriteQueue::push(std::shared_ptr<void const> owner, std::string_view data) {
+  if (data.empty()) return;
+  chunks.push_back({ {}, std::move(owner), data });
+  queued += data.size();
+}
+
+size_t WriteQueue::gather(iovec *iov, size_t max) const {
+  size_t count = 0;
+  for (auto it = chunks.begin(); it != chunks.end() && count < max; ++it, ++count) {
+    auto skip  = count ? 0 : offset;
+    auto data  = it->data();
+    iov[count] = { const_cast<char *>(data.data()) + skip, data.size() - skip };
+  }
+  return count;
+}
+
+void WriteQueue::consume(size_t size) {
+  queued -= size;
+  while (size) {
+    auto left = chunks.front().data().size() - offset;
+    if (size < left) {
+      offset += size;
+      break;
+    }
+    size -= left;
+    offset = 0;
+    chunks.pop_front();
+  }
+}
+
+size_t WriteQueue::length() const { return queued; }
+
+bool WriteQueue::empty() const { return queued == 0; }
 
 InvalidAddress::InvalidAddress()
     : std::runtime_error("invalid address") {}
@@ -117,29 +273,159 @@ HandshakeFailed::HandshakeFailed()
 InvalidFrame::InvalidFrame()
     : std::runtime_error("invalid frame") {}
 
-void safeSend(int fd, std::string_view data) {
-  while (!data.empty()) {
-    auto sent = ::send(fd, &data[0], data.size(), MSG_NOSIGNAL);
+BufferOverflow::BufferOverflow()
+    : std::runtime_error("receive buffer limit exceeded") {}
+
+void setNonBlocking(int fd) {
+  auto flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) throw InvalidSocketOp("fcntl");
+}
+
+// 0 on orderly shutdown, -1 if nothing can be read without blocking
+ssize_t safeRecv(int fd, char *data, size_t length) {
+  auto readed = ::recv(fd, data, length, 0);
+  if (readed == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return -1;
+  if (readed == -1) throw RecvFailed();
+  return readed;
+}
+
+// writes as much of the queue as the socket takes without blocking, true once it is drained
+bool safeFlush(int fd, WriteQueue &queue) {
+  iovec iov[64];
+  while (!queue.empty()) {
+    msghdr msg     = {};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = queue.gather(iov, 64);
+    auto sent      = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent == -1 && errno == EINTR) continue;
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
     if (sent == -1 || sent == 0) throw SendFailed();
-    data.remove_prefix(sent);
+    queue.consume(sent);
+  }
+  return true;
+}
+
+// sends header and payload straight from the caller's memory, returns how much the socket took
+size_t safeWrite(int fd, std::string_view header, std::string_view payload) {
+  size_t sent = 0, total = header.size() + payload.size();
+  while (sent < total) {
+    iovec iov[2];
+    msghdr msg = {};
+    if (sent < header.size()) {
+      iov[0]         = { const_cast<char *>(header.data()) + sent, header.size() - sent };
+      iov[1]         = { const_cast<char *>(payload.data()), payload.size() };
+      msg.msg_iov    = iov;
+      msg.msg_iovlen = payload.empty() ? 1 : 2;
+    } else {
+      iov[0]         = { const_cast<char *>(payload.data()) + (sent - header.size()), total - sent };
+      msg.msg_iov    = iov;
+      msg.msg_iovlen = 1;
+    }
+    auto ret = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (ret == -1 || ret == 0) throw SendFailed();
+    sent += ret;
   }
+  return sent;
 }
 
 #if OPENSSL_ENABLED
-void safeSend(ssl_client *ssl, int fd, std::string_view data) {
-  while (!data.empty()) {
-    ssize_t sent = 0;
-    if (ssl)
-      sent = SSL_write(ssl->client, &data[0], data.size());
-    else
-      sent = ::send(fd, &data[0], data.size(), MSG_NOSIGNAL);
-    if (sent == -1 || sent == 0) throw SendFailed();
-    data.remove_prefix(sent);
+size_t safeWrite(ssl_client *ssl, int fd, std::string_view header, std::string_view payload) {
+  // with kTLS the socket takes plain bytes, so the plain vectored path applies
+  if (!ssl || ssl->kernel_send) return safeWrite(fd, header, payload);
+  // a record per part only pays off once the payload fills a record by itself
+  std::string joined;
+  if (payload.size() < 0x4000) {
+    joined.reserve(header.size() + payload.size());
+    joined.append(header).append(payload);
+    header  = joined;
+    payload = {};
   }
+  size_t sent = 0;
+  for (auto part : { header, payload }) {
+    while (!part.empty()) {
+      auto ret = SSL_write(ssl->client, part.data(), part.size());
+      if (ret <= 0) {
+        switch (SSL_get_error(ssl->client, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE: ssl->pending = part.size(); return sent;
+        default: throw SendFailed();
+        }
+      }
+      ssl->pending = 0;
+      part.remove_prefix(ret);
+      sent += ret;
+    }
+  }
+  return sent;
 }
-#define safeSend(fd, data) safeSend(ssl.get(), fd, data)
+
+ssize_t safeRecv(ssl_client *ssl, int fd, char *data, size_t length) {
+  if (!ssl) return safeRecv(fd, data, length);
+  auto readed = SSL_read(ssl->client, data, length);
+  if (readed > 0) return readed;
+  switch (SSL_get_error(ssl->client, readed)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE: return -1;
+  case SSL_ERROR_ZERO_RETURN: return 0;
+  default: throw RecvFailed();
+  }
+}
+
+bool safeFlush(ssl_client *ssl, int fd, WriteQueue &queue) {
+  if (!ssl || ssl->kernel_send) return safeFlush(fd, queue);
+  iovec iov[64];
+  std::string joined;
+  while (!queue.empty()) {
+    std::string_view data;
+    if (queue.gather(iov, 1); iov[0].iov_len >= ssl->pending)
+      data = { (char const *)iov[0].iov_base, iov[0].iov_len };
+    else {
+      // the blocked write joined chunks that were queued apart, retry with all of them
+      joined.clear();
+      for (size_t i = 0, count = queue.gather(iov, 64); i < count && joined.size() < ssl->pending; i++)
+        joined.append((char const *)iov[i].iov_base, iov[i].iov_len);
+      data = std::string_view{ joined }.substr(0, ssl->pending);
+    }
+    auto sent = SSL_write(ssl->client, data.data(), data.size());
+    if (sent <= 0) {
+      switch (SSL_get_error(ssl->client, sent)) {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE: ssl->pending = data.size(); return false;
+      default: throw SendFailed();
+      }
+    }
+    ssl->pending = 0;
+    queue.consume(sent);
+  }
+  return true;
+}
+#define safeRecv(fd, data, length) safeRecv(ssl.get(), fd, data, length)
+#define safeWrite(fd, header, payload) safeWrite(ssl.get(), fd, header, payload)
+#define safeFlush(fd, queue) safeFlush(ssl.get(), fd, queue)
 #endif
 
+// queues whatever part of header + payload the socket did not take, payload is shared when it has an owner
+void queueRemainder(WriteQueue &queue, std::string_view header, std::string_view payload, size_t sent, std::shared_ptr<void const> owner = {}) {
+  if (sent < header.size()) {
+    queue.push(header.substr(sent));
+    sent = 0;
+  } else {
+    sent -= header.size();
+  }
+  if (owner)
+    queue.push(std::move(owner), payload.substr(sent));
+  else
+    queue.push(payload.substr(sent));
+}
+
+bool congestion(WriteQueue const &queue, struct watermark marks, bool congested) {
+  if (queue.length() >= marks.high) return true;
+  if (queue.length() <= marks.low) return false;
+  return congested;
+}
+
 bool starts_with(std::string_view &full, std::string_view part) {
   bool res = full.compare(0, part.length(), part) == 0;
   if (res) full.remove_prefix(part.length());
@@ -152,7 +438,7 @@ std::string_view eat(std::string_view &full, std::size_t length) {
   return ret;
 }
 
-server_wsio::server_wsio(std::string_view address, std::shared_ptr<epoll> ep)
+server_wsio::server_wsio(std::string_view address, std::shared_ptr<epoll> ep, bool reuseport)
     : ep(std::move(ep)) {
   if (starts_with(address, "ws://")) {
     auto end = address.find_first_of("[:/");
@@ -195,12 +481,17 @@ server_wsio::server_wsio(std::string_view address, std::shared_ptr<epoll> ep)
       int yes = 1;
       ret     = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
       if (ret != 0) throw InvalidSocketOp("setsockopt");
+      if (reuseport) {
+        ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        if (ret != 0) throw InvalidSocketOp("setsockopt");
+      }
       ret = bind(fd, (sockaddr *)&addr[0], addr.length());
       if (ret != 0) throw InvalidSocketOp("bind");
       ret = listen(fd, 0xFF);
       if (ret != 0) throw InvalidSocketOp("listen");
     }
   } else if (starts_with(address, "ws+unix://")) {
+    if (reuseport) throw InvalidAddress();
     std::string host{ address };
     if (host.length() >= 108) throw InvalidAddress();
     path = "/";
@@ -220,7 +511,7 @@ server_wsio::server_wsio(std::string_view address, std::shared_ptr<epoll> ep)
 }
 
 #if OPENSSL_ENABLED
-server_wsio::server_wsio(std::unique_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep)
+server_wsio::server_wsio(std::shared_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep, bool reuseport)
     : ep(std::move(ep))
     , ssl(std::move(context)) {
   if (starts_with(address, "wss://")) {
@@ -264,12 +555,17 @@ server_wsio::server_wsio(std::unique_ptr<ssl_context> context, std::string_view
       int yes = 1;
       ret     = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
       if (ret != 0) throw InvalidSocketOp("setsockopt");
+      if (reuseport) {
+        ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        if (ret != 0) throw InvalidSocketOp("setsockopt");
+      }
       ret = bind(fd, (sockaddr *)&addr[0], addr.length());
       if (ret != 0) throw InvalidSocketOp("bind");
       ret = listen(fd, 0xFF);
       if (ret != 0) throw InvalidSocketOp("listen");
     }
   } else if (starts_with(address, "wss+unix://")) {
+    if (reuseport) throw InvalidAddress();
     std::string host{ address };
     if (host.length() >= 108) throw InvalidAddress();
     path = "/";
@@ -300,27 +596,34 @@ struct AutoClose {
 };
 
 void server_wsio::accept(accept_fn process, remove_fn del, recv_fn rcv) {
+  removed        = del;
   auto client_id = ep->reg([=](epoll_event const &e) {
     if (auto it = fdmap.find(e.data.fd); it != fdmap.end()) {
       auto &[remote, client] = *it;
       try {
-        if (e.events & EPOLLERR) {
-          throw InvalidSocketOp("epoll");
-        } else if (e.events & EPOLLIN) {
-          switch (client->handle(rcv)) {
-          case client::result::ACCEPT: process(client); break;
-          case client::result::STOPPED: throw CommonException();
-          case client::result::EMPTY: break;
+        auto events = e.events;
+        if (events & EPOLLERR) throw InvalidSocketOp("epoll");
+#if OPENSSL_ENABLED
+        if (!client->secured) {
+          if (!client->secure()) return;
+          // the last handshake read may have pulled in the first request as well
+          events |= EPOLLIN;
+        }
+#endif
+        if (events & EPOLLOUT) client->flush();
+        if (events & EPOLLIN) {
+          // frames that came with the upgrade request are read right after it is accepted
+          for (auto more = true; more;) {
+            switch (client->handle(rcv)) {
+            case client::result::ACCEPT: process(client); break;
+            case client::result::STOPPED: throw CommonException();
+            case client::result::EMPTY: more = false; break;
+            }
           }
-        } else {
+        } else if (!(events & EPOLLOUT)) {
           throw CommonException();
         }
-      } catch (...) {
-        del(it->second);
-        ep->del(remote);
-        fdmap.erase(it);
-        close(remote);
-      }
+      } catch (...) { drop(it); }
     }
   });
   ep->add(EPOLLIN, fd, ep->reg([=](epoll_event const &e) {
@@ -332,76 +635,206 @@ void server_wsio::accept(accept_fn process, remove_fn del, recv_fn rcv) {
     socklen_t len       = sizeof(ad);
     auto remote         = ::accept4(fd, (sockaddr *)&ad, &len, SOCK_CLOEXEC);
     if (remote == -1) throw InvalidSocketOp("accept");
+    std::shared_ptr<server_wsio::client> client;
 #if OPENSSL_ENABLED
     try {
       if (ssl)
-        fdmap[remote] = std::make_shared<server_wsio::client>(std::make_shared<ssl_client>(*ssl, remote, false), remote, path);
+        client = std::make_shared<server_wsio::client>(std::make_shared<ssl_client>(*ssl, remote, false), remote, path, ep, buffers, &supported);
       else
 #endif
-        fdmap[remote] = std::make_shared<server_wsio::client>(remote, path);
-      ep->add(EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP, remote, client_id);
+        client = std::make_shared<server_wsio::client>(remote, path, ep, buffers, &supported);
 #if OPENSSL_ENABLED
-    } catch (SSLError const &e) { close(remote); }
+    } catch (SSLError const &e) {
+      close(remote);
+      return;
+    }
 #endif
+    setNonBlocking(remote);
+    client->watermark(marks, on_congestion);
+    fdmap[remote] = client;
+    ep->add(EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP, remote, client_id);
   }));
 }
 
 void server_wsio::shutdown() {
+  ep->cancel(sweeper);
   ep->del(fd);
-  for (auto &[fd, _] : fdmap) {
+  // shut down first, so concurrent writes see fd == -1 before the fd leaves epoll
+  for (auto &[fd, client] : fdmap) {
+    client->disarm();
+    client->shutdown();
     ep->del(fd);
-    ::shutdown(fd, SHUT_RDWR);
-    close(fd);
+  }
+  fdmap.clear();
+}
+
+void server_wsio::watermark(struct watermark marks, congestion_fn fn) {
+  this->marks   = marks;
+  on_congestion = fn;
+}
+
+server_wsio::client_map::iterator server_wsio::drop(client_map::iterator it) {
+  auto client = it->second;
+  if (removed) removed(client);
+  // the last reference may go on any thread, so the wheel is cleared here on the loop
+  client->disarm();
+  // a write racing with the drop sees fd == -1 and stops before touching epoll
+  client->shutdown();
+  ep->del(it->first);
+  return fdmap.erase(it);
+}
+
+void server_wsio::keepalive(struct keepalive config) {
+  auto arm = [self = std::weak_ptr<server_wsio *>(self), config] {
+    auto server = self.lock();
+    if (!server) return;
+    auto &io    = **server;
+    io.liveness = config;
+    io.ep->cancel(io.sweeper);
+    auto interval = config.ping.count() > 0 ? config.ping : config.idle / 2;
+    if (interval.count() > 0) io.sweeper = io.ep->schedule(interval, [&io] { io.sweep(); }, interval);
+  };
+  if (ep->in_loop())
+    arm();
+  else
+    ep->post(arm);
+}
+
+server_wsio::keepalive_stats server_wsio::keepalive_statistics() const { return { pings, reaped_idle, reaped_dead }; }
+
+// one pass over every connection of this reactor, messages seen since the last pass count as activity now
+void server_wsio::sweep() {
+  auto now = timer_wheel::clock::now();
+  for (auto it = fdmap.begin(); it != fdmap.end();) {
+    auto &client = *it->second;
+    if (std::exchange(client.active, false)) client.last_active = now;
+    if (client.heard)
+      client.missed = 0;
+    else if (client.pinged)
+      client.missed++;
+    client.heard = client.pinged = false;
+    try {
+      if (liveness.idle.count() > 0 && now - client.last_active >= liveness.idle) {
+        reaped_idle++;
+        if (client.state == State::STATE_NORMAL) client.write(Frame<Input>{ FrameType::CLOSING_FRAME });
+        it = drop(it);
+        continue;
+      }
+      if (liveness.ping.count() > 0 && client.missed >= std::max(liveness.missed, 1u)) {
+        reaped_dead++;
+        it = drop(it);
+        continue;
+      }
+      if (liveness.ping.count() > 0 && client.state == State::STATE_NORMAL) {
+        client.write(Frame<Input>{ FrameType::PING_FRAME });
+        client.pinged = true;
+        pings++;
+      }
+      ++it;
+    } catch (...) { it = drop(it); }
   }
 }
 
-server_wsio::client::client(int fd, std::string_view path)
+server_wsio::client::client(int fd, std::string_view path, std::shared_ptr<epoll> ep, std::shared_ptr<BufferPool> pool,
+                            std::vector<std::string> const *supported)
     : fd(fd)
     , path(path)
+    , supported(supported)
+    , ep(std::move(ep))
     , state(State::STATE_OPENING)
-    , type(FrameType::INCOMPLETE_FRAME) {}
+    , type(FrameType::INCOMPLETE_FRAME)
+    , buffer(std::move(pool)) {}
 
 #if OPENSSL_ENABLED
-server_wsio::client::client(std::shared_ptr<ssl_client> ssl, int fd, std::string_view path)
+server_wsio::client::client(std::shared_ptr<ssl_client> ssl, int fd, std::string_view path, std::shared_ptr<epoll> ep,
+                            std::shared_ptr<BufferPool> pool, std::vector<std::string> const *supported)
     : ssl(ssl)
+    , secured(false)
     , fd(fd)
     , path(path)
+    , supported(supported)
+    , ep(std::move(ep))
     , state(State::STATE_OPENING)
-    , type(FrameType::INCOMPLETE_FRAME) {}
+    , type(FrameType::INCOMPLETE_FRAME)
+    , buffer(std::move(pool)) {}
+
+bool server_wsio::client::secure() {
+  if (secured) return true;
+  auto done = ssl->handshake();
+  // nothing is queued before the handshake is done, so EPOLLOUT interest belongs to it alone
+  auto out = !done && ssl->want_write;
+  if (out != polling_out) {
+    ep->mod((out ? EPOLLOUT : EPOLLIN) | EPOLLERR | EPOLLHUP | EPOLLRDHUP, fd);
+    polling_out = out;
+  }
+  return secured = done;
+}
 #endif
 
 server_wsio::client::~client() { shutdown(); }
 
 void server_wsio::client::shutdown() {
+  std::lock_guard guard{ send_mtx };
+  if (fd == -1) return;
 #if OPENSSL_ENABLED
   if (ssl) ssl->shutdown();
 #endif
   ::shutdown(fd, SHUT_WR);
   close(fd);
+  fd = -1;
 }
 
-server_wsio::client::result server_wsio::client::handle(server_wsio::recv_fn const &process) {
-  Handshake hs;
-  Frame<Output> oframe;
+// full reads per readiness event, a peer that keeps the socket full cannot starve the others
+static constexpr size_t max_reads = 16;
+// free space a read asks for, the rest of a slab is used before the buffer grows
+static constexpr size_t min_read = 0x1000;
 
+// reads until the socket is drained or max_reads is reached, the rest raises the next level-triggered event
+server_wsio::client::result server_wsio::client::handle(server_wsio::recv_fn const &process) {
   if (type != FrameType::INCOMPLETE_FRAME) return result::STOPPED;
-  ssize_t readed = 0;
+  // frames pipelined behind the upgrade request are already buffered
+  if (state == State::STATE_NORMAL && buffer.length())
+    if (auto ret = parse(process); ret != result::EMPTY) return ret;
+  for (size_t reads = 1;; reads++) {
+    auto data = buffer.allocate(min_read);
+    auto room = buffer.space();
+    ssize_t readed;
+    // records OpenSSL already pulled off the socket raise no epoll event
+    bool pending = false;
+    {
+      // other threads send under send_mtx, which keeps them off the SSL object while it reads
+      std::unique_lock guard{ send_mtx, std::defer_lock };
 #if OPENSSL_ENABLED
-  if (ssl)
-    readed = SSL_read(ssl->client, buffer.allocate(0xFFFF), 0xFFFF);
-  else
+      if (ssl) guard.lock();
+#endif
+      readed = safeRecv(fd, data, room);
+#if OPENSSL_ENABLED
+      pending = readed > 0 && ssl && SSL_has_pending(ssl->client);
 #endif
-    readed = ::recv(fd, buffer.allocate(0xFFFF), 0xFFFF, 0);
-  if (readed == 0) return result::STOPPED;
-  if (readed == -1) { throw RecvFailed(); }
-  buffer.eat(readed);
+    }
+    if (readed == 0) return result::STOPPED;
+    if (readed == -1) {
+      buffer.release();
+      return result::EMPTY;
+    }
+    buffer.eat(readed);
+    heard = true;
+    if (auto ret = parse(process); ret != result::EMPTY) return ret;
+    if (pending) continue;
+    if (static_cast<size_t>(readed) < room || reads == max_reads) return result::EMPTY;
+  }
+}
+
+server_wsio::client::result server_wsio::client::parse(server_wsio::recv_fn const &process) {
+  Handshake hs;
+  Frame<Input> oframe;
 
   if (state == State::STATE_OPENING) {
     hs   = parseHandshake(buffer);
     type = hs.type;
   } else {
   midpoint:
-    oframe = parseFrame(buffer);
+    oframe = parseFrameInPlace(buffer.begin(), buffer.length());
     type   = oframe.type;
   }
 
@@ -410,11 +843,10 @@ server_wsio::client::result server_wsio::client::handle(server_wsio::recv_fn con
       std::ostringstream oss;
       oss << "HTTP/1.1 400 Bad Request\r\n"
           << "Sec-WebSocket-Version: 13\r\n\r\n";
-      safeSend(fd, oss.str());
+      write(oss.str());
       return result::STOPPED;
     } else {
-      auto temp = makeFrame(Frame<Input>{ FrameType::CLOSING_FRAME });
-      safeSend(fd, temp);
+      write(Frame<Input>{ FrameType::CLOSING_FRAME });
       state = State::STATE_CLOSING;
       type  = FrameType::INCOMPLETE_FRAME;
       buffer.reset();
@@ -422,16 +854,24 @@ server_wsio::client::result server_wsio::client::handle(server_wsio::recv_fn con
   }
 
   if (state == State::STATE_OPENING) {
+    if (type == FrameType::INCOMPLETE_FRAME) return result::EMPTY;
     if (type != FrameType::OPENING_FRAME)
-      safeSend(fd, "HTTP/1.1 400 Bad Request\r\n\r\n");
+      write("HTTP/1.1 400 Bad Request\r\n\r\n");
     if (hs.resource != path) {
-      safeSend(fd, "HTTP/1.1 404 Not Found\r\n\r\n");
+      write("HTTP/1.1 404 Not Found\r\n\r\n");
       return result::STOPPED;
     }
 
-    auto answer = makeHandshakeAnswer(hs.key);
+    // the first subprotocol offered by the client that this server supports
+    if (supported)
+      for (auto offered : hs.protocols)
+        if (std::find(supported->begin(), supported->end(), offered) != supported->end()) {
+          subprotocol = offered;
+          break;
+        }
+    auto answer = makeHandshakeAnswer(hs.key, subprotocol);
     hs.reset();
-    safeSend(fd, answer);
+    write(answer);
     state = State::STATE_NORMAL;
     type  = FrameType::INCOMPLETE_FRAME;
     buffer.drop(buffer.view().find("\r\n\r\n") + 4);
@@ -440,14 +880,17 @@ server_wsio::client::result server_wsio::client::handle(server_wsio::recv_fn con
     switch (type) {
     case FrameType::INCOMPLETE_FRAME: return result::EMPTY;
     case FrameType::CLOSING_FRAME:
-      if (state != State::STATE_CLOSING) {
-        auto temp = makeFrame({ FrameType::CLOSING_FRAME });
-        safeSend(fd, temp);
-      }
+      if (state != State::STATE_CLOSING) write(Frame<Input>{ FrameType::CLOSING_FRAME });
       return result::STOPPED;
-    case FrameType::PING_FRAME: safeSend(fd, makeFrame({ FrameType::PONG_FRAME })); break;
-    case FrameType::TEXT_FRAME: process(shared_from_this(), oframe.payload, message_type::TEXT); break;
-    case FrameType::BINARY_FRAME: process(shared_from_this(), oframe.payload, message_type::BINARY); break;
+    case FrameType::PING_FRAME: write(Frame<Input>{ FrameType::PONG_FRAME }); break;
+    case FrameType::TEXT_FRAME:
+      active = true;
+      process(shared_from_this(), oframe.payload, message_type::TEXT);
+      break;
+    case FrameType::BINARY_FRAME:
+      active = true;
+      process(shared_from_this(), oframe.payload, message_type::BINARY);
+      break;
     default: break;
     }
     type = FrameType::INCOMPLETE_FRAME;
@@ -457,8 +900,212 @@ server_wsio::client::result server_wsio::client::handle(server_wsio::recv_fn con
   return result::EMPTY;
 }
 
+void server_wsio::client::write(std::string_view header, std::string_view payload, std::shared_ptr<void const> owner) {
+  bool was_congested, congested;
+  {
+    std::lock_guard guard{ send_mtx };
+    if (fd == -1) return;
+    // anything already queued has to go out first, EPOLLOUT is armed for it
+    queueRemainder(queue, header, payload, queue.empty() ? safeWrite(fd, header, payload) : 0, std::move(owner));
+    if (!queue.empty() && !polling_out) {
+      ep->mod(EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP, fd);
+      polling_out = true;
+    }
+    was_congested = std::exchange(is_congested, congestion(queue, marks, is_congested));
+    congested     = is_congested;
+  }
+  notify(was_congested, congested);
+}
+
+void server_wsio::client::flush() {
+  bool was_congested, congested;
+  {
+    std::lock_guard guard{ send_mtx };
+    if (fd == -1) return;
+    if (safeFlush(fd, queue) && polling_out) {
+      ep->mod(EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP, fd);
+      polling_out = false;
+    }
+    was_congested = std::exchange(is_congested, congestion(queue, marks, is_congested));
+    congested     = is_congested;
+  }
+  notify(was_congested, congested);
+}
+
+void server_wsio::client::notify(bool was_congested, bool congested) {
+  if (was_congested != congested && on_congestion) on_congestion(shared_from_this(), congested);
+}
+
+void server_wsio::client::watermark(struct watermark marks, congestion_fn fn) {
+  std::lock_guard guard{ send_mtx };
+  this->marks   = marks;
+  on_congestion = fn;
+}
+
+size_t server_wsio::client::buffered() {
+  std::lock_guard guard{ send_mtx };
+  return queue.length();
+}
+
+bool server_wsio::client::congested() {
+  std::lock_guard guard{ send_mtx };
+  return is_congested;
+}
+
+void server_wsio::client::write(Frame<Input> const &frame) {
+  char header[max_frame_header];
+  write({ header, writeFrameHeader(header, frame) }, frame.payload);
+}
+
+void server_wsio::client::post(std::function<void()> fn) { ep->post(std::move(fn)); }
+
+server_io::timer_id server_wsio::client::schedule(std::chrono::milliseconds delay, std::function<void()> fn) {
+  auto id  = ++last_timer;
+  auto arm = [self = weak_from_this(), id, delay, fn = std::move(fn)]() mutable {
+    auto client = self.lock();
+    if (!client) return;
+    auto &io = *client;
+    io.timers.emplace(id, io.ep->schedule(delay, [self = io.weak_from_this(), id, fn = std::move(fn)] {
+      auto client = self.lock();
+      if (!client) return;
+      client->timers.erase(id);
+      fn();
+    }));
+  };
+  if (ep->in_loop())
+    arm();
+  else
+    ep->post(std::move(arm));
+  return id;
+}
+
+void server_wsio::client::disarm() {
+  for (auto &[id, timer] : timers) ep->cancel(timer);
+  timers.clear();
+}
+
+void server_wsio::client::cancel(timer_id id) {
+  auto disarm = [self = weak_from_this(), id] {
+    auto client = self.lock();
+    if (!client) return;
+    if (auto it = client->timers.find(id); it != client->timers.end()) {
+      client->ep->cancel(it->second);
+      client->timers.erase(it);
+    }
+  };
+  if (ep->in_loop())
+    disarm();
+  else
+    ep->post(disarm);
+}
+
 void server_wsio::client::send(std::string_view data, message_type type) {
-  safeSend(fd, makeFrame({ type == message_type::BINARY ? FrameType::BINARY_FRAME : FrameType::TEXT_FRAME, data }));
+  write(Frame<Input>{ type == message_type::BINARY ? FrameType::BINARY_FRAME : FrameType::TEXT_FRAME, data });
+}
+
+void server_wsio::client::send(std::shared_ptr<prepared const> const &msg) {
+  if (auto frame = dynamic_cast<prepared_frame const *>(msg.get()))
+    write({}, frame->data, msg);
+  else
+    send(msg->payload(), msg->type);
+}
+
+server_wsio::prepared_frame::prepared_frame(std::string data, message_type type, size_t header)
+    : prepared(std::move(data), type)
+    , header(header) {}
+
+std::string_view server_wsio::prepared_frame::payload() const { return std::string_view{ data }.substr(header); }
+
+std::string_view server_wsio::client::protocol() const { return subprotocol; }
+
+void server_wsio::protocols(std::vector<std::string> list) { supported = std::move(list); }
+
+std::shared_ptr<server_io::prepared const> server_wsio::prepare(std::string_view data, message_type type) {
+  char header[max_frame_header];
+  auto length = writeFrameHeader(header, Frame<Input>{ type == message_type::BINARY ? FrameType::BINARY_FRAME : FrameType::TEXT_FRAME, data });
+  std::string encoded;
+  encoded.reserve(length + data.size());
+  encoded.append(header, length).append(data);
+  return std::make_shared<prepared_frame>(std::move(encoded), type, length);
+}
+
+sharded_server_wsio::sharded_server_wsio(std::string_view address, size_t count) {
+  for (size_t i = 0; i < std::max(count, size_t(1)); i++) shards.emplace_back(std::make_unique<server_wsio>(address, std::make_shared<epoll>(), true));
+}
+
+#if OPENSSL_ENABLED
+sharded_server_wsio::sharded_server_wsio(std::shared_ptr<ssl_context> context, std::string_view address, size_t count) {
+  for (size_t i = 0; i < std::max(count, size_t(1)); i++)
+    shards.emplace_back(std::make_unique<server_wsio>(context, address, std::make_shared<epoll>(), true));
+}
+#endif
+
+sharded_server_wsio::~sharded_server_wsio() {
+  shutdown();
+  join();
+}
+
+void sharded_server_wsio::accept(accept_fn process, remove_fn del, recv_fn rcv) {
+  for (auto &shard : shards) shard->accept(process, del, rcv);
+  for (size_t i = 1; i < shards.size(); i++)
+    threads.emplace_back([this, &ep = shards[i]->handler()] {
+      try {
+        ep.wait();
+      } catch (...) {
+        {
+          std::lock_guard guard{ mtx };
+          if (!failure) failure = std::current_exception();
+        }
+        shutdown();
+      }
+    });
+}
+
+void sharded_server_wsio::protocols(std::vector<std::string> list) {
+  for (auto &shard : shards) shard->protocols(list);
+}
+
+// every shard encodes frames the same way
+std::shared_ptr<server_io::prepared const> sharded_server_wsio::prepare(std::string_view data, message_type type) {
+  return shards.front()->prepare(data, type);
+}
+
+void sharded_server_wsio::keepalive(struct keepalive config) {
+  for (auto &shard : shards) shard->keepalive(config);
+}
+
+server_wsio::keepalive_stats sharded_server_wsio::keepalive_statistics() const {
+  server_wsio::keepalive_stats total = {};
+  for (auto &shard : shards) {
+    auto stats = shard->keepalive_statistics();
+    total.pings += stats.pings;
+    total.idle += stats.idle;
+    total.dead += stats.dead;
+  }
+  return total;
+}
+
+void sharded_server_wsio::shutdown() {
+  for (auto &shard : shards) shard->handler().shutdown();
+}
+
+void sharded_server_wsio::wait() {
+  try {
+    shards[0]->handler().wait();
+  } catch (...) {
+    shutdown();
+    join();
+    throw;
+  }
+  join();
+  std::lock_guard guard{ mtx };
+  if (failure) std::rethrow_exception(std::exchange(failure, nullptr));
+}
+
+void sharded_server_wsio::join() {
+  for (auto &thread : threads)
+    if (thread.joinable()) thread.join();
+  threads.clear();
 }
 
 std::string base64(std::string_view input) {
@@ -479,8 +1126,9 @@ std::string base64(std::string_view input) {
   return out;
 }
 
-client_wsio::client_wsio(std::string_view address, std::shared_ptr<epoll> ep)
-    : ep(std::move(ep)) {
+client_wsio::client_wsio(std::string_view address, std::shared_ptr<epoll> ep, std::vector<std::string> protocols)
+    : ep(std::move(ep))
+    , offered(std::move(protocols)) {
   std::string hoststr;
   if (starts_with(address, "ws://")) {
     auto end = address.find_first_of("[:/");
@@ -548,21 +1196,24 @@ client_wsio::client_wsio(std::string_view address, std::shared_ptr<epoll> ep)
 
   {
     auto handshake = makeHandshake({
-        .type     = FrameType::OPENING_FRAME,
-        .host     = hoststr,
-        .origin   = hoststr,
-        .key      = key,
-        .resource = path,
+        .type      = FrameType::OPENING_FRAME,
+        .host      = hoststr,
+        .origin    = hoststr,
+        .key       = key,
+        .resource  = path,
+        .protocols = { offered.begin(), offered.end() },
     });
-    safeSend(fd, handshake);
+    write(handshake);
   }
 }
 
 #if OPENSSL_ENABLED
-client_wsio::client_wsio(std::unique_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep)
+client_wsio::client_wsio(std::shared_ptr<ssl_context> context, std::string_view address, std::shared_ptr<epoll> ep,
+                         std::vector<std::string> protocols)
     : ep(std::move(ep))
+    , offered(std::move(protocols))
     , sslctx(std::move(context)) {
-  std::string hoststr;
+  std::string hoststr, peer;
   if (starts_with(address, "wss://")) {
     auto end = address.find_first_of("[:/");
     if (end == std::string_view::npos) throw InvalidAddress();
@@ -586,6 +1237,7 @@ client_wsio::client_wsio(std::unique_ptr<ssl_context> context, std::string_view
       if (end == std::string_view::npos) throw InvalidAddress();
       port = eat(address, end);
     }
+    peer = hoststr + ":" + std::string(port);
     path = eat(address, address.find_first_of("?#"));
     {
       std::string host_str{ host };
@@ -607,6 +1259,7 @@ client_wsio::client_wsio(std::unique_ptr<ssl_context> context, std::string_view
     }
   } else if (starts_with(address, "wss+unix://")) {
     hoststr = address;
+    peer    = hoststr;
     if (hoststr.length() >= 108) throw InvalidAddress();
     path = "/";
     {
@@ -621,6 +1274,9 @@ client_wsio::client_wsio(std::unique_ptr<ssl_context> context, std::string_view
     throw InvalidAddress();
 
   ssl = std::make_shared<ssl_client>(*sslctx, fd, true);
+  sslctx->resume(*ssl, std::move(peer));
+  // the socket is still blocking here, so the handshake runs to its end
+  if (!ssl->handshake()) throw HandshakeFailed{};
 
   union {
     uint64_t u2[2] = { std::experimental::randint((uint64_t)0, UINT64_MAX), std::experimental::randint((uint64_t)0, UINT64_MAX) };
@@ -631,27 +1287,78 @@ client_wsio::client_wsio(std::unique_ptr<ssl_context> context, std::string_view
 
   {
     auto handshake = makeHandshake({
-        .type     = FrameType::OPENING_FRAME,
-        .host     = hoststr,
-        .origin   = hoststr,
-        .key      = key,
-        .resource = path,
+        .type      = FrameType::OPENING_FRAME,
+        .host      = hoststr,
+        .origin    = hoststr,
+        .key       = key,
+        .resource  = path,
+        .protocols = { offered.begin(), offered.end() },
     });
-    safeSend(fd, handshake);
+    write(handshake);
   }
 }
 #endif
 
 void client_wsio::ondie(std::function<void()> ondie_cb) { ondie_cbs.emplace_back(ondie_cb); }
 
+// epoll::defer belongs to the loop thread, other threads hand the task over with post
+void client_wsio::defer(std::function<void()> fn) {
+  if (ep->in_loop())
+    ep->defer(std::move(fn));
+  else
+    ep->post(std::move(fn));
+}
+
+std::string_view client_wsio::protocol() const { return subprotocol; }
+
+client_io::timer_id client_wsio::schedule(std::chrono::milliseconds delay, std::function<void()> fn) {
+  auto id  = ++last_timer;
+  auto arm = [self = std::weak_ptr<client_wsio *>(self), id, delay, fn = std::move(fn)]() mutable {
+    auto client = self.lock();
+    if (!client) return;
+    auto &io = **client;
+    io.timers.emplace(id, io.ep->schedule(delay, [&io, id, fn = std::move(fn)] {
+      io.timers.erase(id);
+      fn();
+    }));
+  };
+  if (ep->in_loop())
+    arm();
+  else
+    ep->post(std::move(arm));
+  return id;
+}
+
+void client_wsio::cancel(timer_id id) {
+  auto disarm = [self = std::weak_ptr<client_wsio *>(self), id] {
+    auto client = self.lock();
+    if (!client) return;
+    auto &io = **client;
+    if (auto it = io.timers.find(id); it != io.timers.end()) {
+      io.ep->cancel(it->second);
+      io.timers.erase(it);
+    }
+  };
+  if (ep->in_loop())
+    disarm();
+  else
+    ep->post(disarm);
+}
+
 void client_wsio::shutdown() {
-  if (alive()) {
+  bool was_registered;
+  {
+    std::lock_guard guard{ send_mtx };
+    was_registered = std::exchange(registered, false);
+  }
+  if (was_registered) {
     ep->del(fd);
     for (auto cb : ondie_cbs) cb();
   }
 }
 
 client_wsio::~client_wsio() {
+  for (auto &[id, timer] : timers) ep->cancel(timer);
 #if OPENSSL_ENABLED
   if (ssl) ssl->shutdown();
 #endif
@@ -660,62 +1367,145 @@ client_wsio::~client_wsio() {
 }
 
 void client_wsio::recv(recv_fn rcv, promise<void>::resolver resolver) {
+  setNonBlocking(fd);
+  // registered is set before the fd can raise its first event
+  {
+    std::lock_guard guard{ send_mtx };
+    registered = true;
+  }
   ep->add(EPOLLIN, fd, ep->reg([=](epoll_event const &e) {
     if (e.events & EPOLLERR) {
       shutdown();
       return resolver.reject(InvalidSocketOp("epoll_wait"));
     }
 
-    ssize_t readed = 0;
-#if OPENSSL_ENABLED
-    if (ssl)
-      readed = SSL_read(ssl->client, buffer.allocate(0xFFFF), 0xFFFF);
-    else
-#endif
-      readed = ::recv(fd, buffer.allocate(0xFFFF), 0xFFFF, 0);
-    if (readed == 0) {
+    try {
+      if (e.events & EPOLLOUT) flush();
+      if (e.events == EPOLLOUT) return;
+    } catch (...) {
       shutdown();
-      return;
+      return resolver.reject(std::current_exception());
     }
-    if (readed == -1) {
-      shutdown();
-      return resolver.reject(RecvFailed());
+
+    for (size_t reads = 1;; reads++) {
+      ssize_t readed;
+      size_t room;
+      // records OpenSSL already pulled off the socket raise no epoll event
+      bool pending = false;
+      try {
+        auto data = buffer.allocate(min_read);
+        room      = buffer.space();
+        // calls from other threads send under send_mtx, which keeps them off the SSL object while it reads
+        std::unique_lock guard{ send_mtx, std::defer_lock };
+#if OPENSSL_ENABLED
+        if (ssl) guard.lock();
+#endif
+        readed = safeRecv(fd, data, room);
+#if OPENSSL_ENABLED
+        pending = readed > 0 && ssl && SSL_has_pending(ssl->client);
+#endif
+      } catch (...) {
+        shutdown();
+        return resolver.reject(std::current_exception());
+      }
+      if (readed == 0) {
+        shutdown();
+        return;
+      }
+      if (readed == -1) return buffer.release();
+      buffer.eat(readed);
+
+      if (state == State::STATE_OPENING) {
+        if (auto ending = buffer.view().find("\r\n\r\n"); ending != std::string_view::npos) {
+          auto protocol = parseHandshakeAnswer(buffer.view().substr(0, ending + 4), key);
+          if (protocol.empty()) return resolver.reject(HandshakeFailed{});
+          // "websocket" means the server picked no subprotocol, anything else has to be one we offered
+          if (protocol != "websocket") {
+            if (std::find(offered.begin(), offered.end(), protocol) == offered.end()) return resolver.reject(HandshakeFailed{});
+            subprotocol = protocol;
+          }
+          resolver.resolve();
+          state = State::STATE_NORMAL;
+          buffer.drop(ending + 4);
+        }
+      }
+      if (state != State::STATE_OPENING)
+        while (buffer.length()) {
+          auto oframe = parseServerFrame(buffer);
+          if (oframe.type == FrameType::INCOMPLETE_FRAME) break;
+          switch (oframe.type) {
+          case FrameType::ERROR_FRAME: return resolver.reject(InvalidFrame{});
+          case FrameType::CLOSING_FRAME: shutdown(); return;
+          case FrameType::PING_FRAME: write(makeFrame({ FrameType::PONG_FRAME }, true)); break;
+          case FrameType::TEXT_FRAME: rcv(oframe.payload, message_type::TEXT); break;
+          case FrameType::BINARY_FRAME: rcv(oframe.payload, message_type::BINARY); break;
+          default: break;
+          }
+          buffer.drop(oframe.eaten);
+        }
+      if (pending) continue;
+      if (static_cast<size_t>(readed) < room || reads == max_reads) return;
     }
-    buffer.eat(readed);
+  }));
+}
 
-    Frame<Input> oframe;
-    FrameType type = FrameType::INCOMPLETE_FRAME;
+void client_wsio::send(std::string_view data, message_type type) {
+  write(makeFrame({ type == message_type::BINARY ? FrameType::BINARY_FRAME : FrameType::TEXT_FRAME, data }, true));
+}
 
-    if (state == State::STATE_OPENING) {
-      if (parseHandshakeAnswer(buffer, key).empty()) return resolver.reject(HandshakeFailed{});
-      resolver.resolve();
-      state = State::STATE_NORMAL;
-      buffer.reset();
-      return;
-    } else {
-    midpoint:
-      oframe = parseServerFrame(buffer);
-      type   = oframe.type;
+void client_wsio::write(std::string_view data) {
+  bool was_congested, congested;
+  {
+    std::lock_guard guard{ send_mtx };
+    queueRemainder(queue, data, {}, queue.empty() ? safeWrite(fd, data, {}) : 0);
+    // the socket stays blocking until recv() registers it, so this only happens afterwards
+    if (!queue.empty() && !polling_out && registered) {
+      ep->mod(EPOLLIN | EPOLLOUT, fd);
+      polling_out = true;
     }
+    was_congested = std::exchange(is_congested, congestion(queue, marks, is_congested));
+    congested     = is_congested;
+  }
+  notify(was_congested, congested);
+}
 
-    switch (type) {
-    case FrameType::ERROR_FRAME: return resolver.reject(InvalidFrame{});
-    case FrameType::CLOSING_FRAME: shutdown(); return;
-    case FrameType::PING_FRAME: safeSend(fd, makeFrame({ FrameType::PONG_FRAME }, true)); break;
-    case FrameType::TEXT_FRAME: rcv(oframe.payload, message_type::TEXT); break;
-    case FrameType::BINARY_FRAME: rcv(oframe.payload, message_type::BINARY); break;
-    default: break;
+void client_wsio::flush() {
+  bool was_congested, congested;
+  {
+    std::lock_guard guard{ send_mtx };
+    if (safeFlush(fd, queue) && polling_out) {
+      ep->mod(EPOLLIN, fd);
+      polling_out = false;
     }
-    buffer.drop(oframe.eaten);
-    if (buffer.length()) goto midpoint;
-  }));
+    was_congested = std::exchange(is_congested, congestion(queue, marks, is_congested));
+    congested     = is_congested;
+  }
+  notify(was_congested, congested);
 }
 
-void client_wsio::send(std::string_view data, message_type type) {
-  auto frame = makeFrame({ type == message_type::BINARY ? FrameType::BINARY_FRAME : FrameType::TEXT_FRAME, data }, true);
-  safeSend(fd, frame);
+void client_wsio::notify(bool was_congested, bool congested) {
+  if (was_congested != congested && on_congestion) on_congestion(congested);
+}
+
+void client_wsio::watermark(struct watermark marks, std::function<void(bool)> fn) {
+  std::lock_guard guard{ send_mtx };
+  this->marks   = marks;
+  on_congestion = fn;
+}
+
+size_t client_wsio::buffered() {
+  std::lock_guard guard{ send_mtx };
+  return queue.length();
+}
+
+bool client_wsio::congested() {
+  std::lock_guard guard{ send_mtx };
+  return is_congested;
 }
 
-bool client_wsio::alive() { return ep->has(fd); }
+bool client_wsio::alive() {
+  std::lock_guard guard{ send_mtx };
+  return registered;
+}
 
 } // namespace rpcws
\ No newline at end of file
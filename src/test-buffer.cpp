@@ -0,0 +1,49 @@
+#include <iostream>
+#include <rpcws.hpp>
+#include <sys/socket.h>
+
+// Every connection gets half of a frame per read, so all of them hold a partial
+// frame at once. The pool has to serve that from its slabs: after the first round
+// no further storage may be created, however many rounds follow.
+
+using namespace rpcws;
+
+static constexpr size_t connections = 64;
+static constexpr size_t rounds      = 100;
+
+int main() {
+  auto ep   = std::make_shared<epoll>();
+  auto pool = std::make_shared<BufferPool>();
+  std::vector<std::shared_ptr<server_wsio::client>> clients;
+  std::vector<int> peers;
+  size_t messages = 0;
+  server_io::recv_fn count = [&](auto, std::string_view, message_type) { messages++; };
+
+  for (size_t i = 0; i < connections; i++) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0) throw std::runtime_error("socketpair");
+    clients.emplace_back(std::make_shared<server_wsio::client>(fds[0], "/", ep, pool));
+    peers.emplace_back(fds[1]);
+    auto upgrade = makeHandshake({ .type = FrameType::OPENING_FRAME, .host = "localhost", .key = "dGhlIHNhbXBsZSBub25jZQ==", .resource = "/" });
+    write(fds[1], upgrade.data(), upgrade.size());
+    if (clients.back()->handle(count) != server_wsio::client::result::ACCEPT) throw std::runtime_error("upgrade failed");
+  }
+
+  auto frame = makeFrame({ FrameType::TEXT_FRAME, std::string(3000, 'x') }, true);
+  std::string_view halves[] = { std::string_view{ frame }.substr(0, frame.size() / 2), std::string_view{ frame }.substr(frame.size() / 2) };
+  size_t created = 0;
+  for (size_t round = 0; round < rounds; round++) {
+    for (auto half : halves)
+      for (size_t i = 0; i < connections; i++) {
+        write(peers[i], half.data(), half.size());
+        clients[i]->handle(count);
+      }
+    if (!round) created = pool->statistics().created;
+  }
+
+  auto stats = pool->statistics();
+  std::cout << messages << " messages, " << stats.created << " slabs created, " << stats.reused << " reused" << std::endl;
+  for (auto &client : clients) client->shutdown();
+  for (auto fd : peers) close(fd);
+  return messages == connections * rounds && stats.created == created && created <= connections ? 0 : 1;
+}
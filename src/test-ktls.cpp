@@ -0,0 +1,84 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <rpcws.hpp>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Handshakes over loopback with kernel TLS requested on both contexts and reports
+// whether the kernel took over the records, then checks a message still gets across.
+// Offload needs the tls module and a cipher the kernel knows, otherwise OpenSSL keeps
+// the records and this prints "no" for every direction.
+
+using namespace rpcws;
+
+static constexpr auto message = "kernel tls";
+
+static char const *yes(bool value) { return value ? "yes" : "no"; }
+
+static void report(char const *side, ssl_client &tls) {
+  std::cout << side << ": send " << yes(tls.kernel_send);
+#ifdef SSL_OP_ENABLE_KTLS
+  std::cout << ", recv " << yes(BIO_get_ktls_recv(SSL_get_rbio(tls.client)));
+#endif
+  std::cout << std::endl;
+}
+
+int main(int argc, char **argv) {
+  OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+  auto cert = argc > 2 ? argv[1] : "./cert.pem";
+  auto priv = argc > 2 ? argv[2] : "./priv.key";
+
+  try {
+#ifndef SSL_OP_ENABLE_KTLS
+    std::cout << "OpenSSL built without kernel TLS" << std::endl;
+#endif
+    ssl_context server_ctx{ cert, priv }, client_ctx;
+    server_ctx.ktls(true);
+    client_ctx.ktls(true);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len        = sizeof addr;
+    if (bind(listener, (sockaddr *)&addr, len) != 0 || listen(listener, 1) != 0) throw std::runtime_error("listen");
+    getsockname(listener, (sockaddr *)&addr, &len);
+
+    std::string received;
+    std::thread server([&] {
+      int remote = accept(listener, nullptr, nullptr);
+      {
+        ssl_client tls{ server_ctx, remote };
+        // blocking sockets, so the handshake either finishes or throws
+        tls.handshake();
+        report("server", tls);
+        char data[64];
+        auto readed = SSL_read(tls.client, data, sizeof data);
+        if (readed > 0) received.assign(data, readed);
+      }
+      close(remote);
+    });
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (sockaddr *)&addr, len) != 0) throw std::runtime_error("connect");
+    {
+      ssl_client tls{ client_ctx, fd, true };
+      tls.handshake();
+      report("client", tls);
+      SSL_write(tls.client, message, strlen(message));
+      server.join();
+    }
+    close(fd);
+    close(listener);
+
+    std::cout << "message " << (received == message ? "received" : "lost") << std::endl;
+    return received == message ? 0 : 1;
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -14,7 +14,7 @@ int main() {
         .then([] {
           server.reg("test", [](auto x, json data) -> promise<json> { return client.call("test", data); });
           server.reg("error", [](auto x, json data) -> promise<json> { return client.call("error", data); });
-          server.reg(std::regex("^proxied\\.(\\S+)$"),
+          server.reg(route("^proxied\\.(\\S+)$"),
                      [](auto x, auto matched, json data) -> promise<json> { return client.call(matched[1].str(), data); });
         })
         .fail([&](auto ex) {
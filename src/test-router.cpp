@@ -0,0 +1,45 @@
+#include <iostream>
+#include <rpc.hpp>
+
+// Routes compiled with grammars other than ECMAScript have to reach their handlers
+// even where their escapes mean something else than in ECMAScript.
+
+using namespace rpc;
+
+struct recorder : server_io::client {
+  std::string last;
+  void shutdown() override {}
+  void send(std::string_view data, message_type) override { last = data; }
+};
+
+struct direct : server_io {
+  recv_fn recv;
+  void shutdown() override {}
+  void accept(accept_fn, remove_fn, recv_fn rcv) override { recv = rcv; }
+};
+
+int main() {
+  auto io     = std::make_unique<direct>();
+  auto &layer = *io;
+  RPC server{ std::move(io) };
+  auto name = [](auto, auto matched, json) -> json { return matched[0].str(); };
+  server.reg(route("^plain\\.(call)$"), name);
+  server.reg(route("extended\\.(call)", std::regex::extended), name);
+  server.reg(route("basic\\(x\\)\\.call", std::regex::basic), name);
+  server.reg(route("grep\\(x\\)\\{2\\}\\.call", std::regex::grep), name);
+  server.reg(route("awk\\.call", std::regex::awk), name);
+  server.reg(route("^ICASE\\.call$", std::regex::icase), name);
+  server.start();
+
+  auto client = std::make_shared<recorder>();
+  int failed  = 0;
+  for (auto method : { "plain.call", "extended.call", "basicx.call", "grepxx.call", "awk.call", "icase.call" }) {
+    layer.recv(client, json::object({ { "jsonrpc", "2.0" }, { "method", method }, { "params", json::array() }, { "id", 1 } }).dump(),
+               message_type::TEXT);
+    auto reply = json::parse(client->last);
+    auto ok    = reply.contains("result") && reply["result"] == method;
+    if (!ok) failed++;
+    std::cout << method << ": " << (ok ? "routed" : reply.dump()) << std::endl;
+  }
+  return failed ? 1 : 0;
+}
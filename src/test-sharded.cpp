@@ -0,0 +1,23 @@
+#include <csignal>
+#include <iostream>
+#include <rpcws.hpp>
+
+int main() {
+  using namespace rpcws;
+
+  try {
+    static RPC instance{ std::make_unique<sharded_server_wsio>("ws://127.0.0.1:16400/") };
+    instance.reg("test", [](auto client, json data) -> json { return data; });
+    instance.reg("error", [](auto client, json data) -> json { throw std::runtime_error("expected"); });
+    instance.reg(std::regex("^\\S+$"), [](auto client, auto matched, json data) -> json {
+      return json::object({
+          { "name", matched[0].str() },
+          { "data", data },
+      });
+    });
+    signal(SIGINT, [](auto) { instance.stop(); });
+    instance.start();
+    std::cout << "shards: " << instance.layer<sharded_server_wsio>().size() << std::endl;
+    instance.layer<sharded_server_wsio>().wait();
+  } catch (std::runtime_error &e) { std::cerr << e.what() << std::endl; }
+}
@@ -0,0 +1,54 @@
+#include <iostream>
+#include <openssl/ssl.h>
+#include <rpcws.hpp>
+#include <thread>
+
+// The client sends a burst of echo calls and then stops reading for a while, so the
+// server's TLS writes block on a full socket and have to be retried from the queue.
+
+using namespace rpcws;
+
+static constexpr auto address = "wss://127.0.0.1:16432/";
+static constexpr size_t calls = 1000;
+
+int main(int argc, char **argv) {
+  OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+  auto cert = argc > 2 ? argv[1] : "./cert.pem";
+  auto priv = argc > 2 ? argv[2] : "./priv.key";
+
+  try {
+    auto sep = std::make_shared<epoll>();
+    RPC server{ std::make_unique<server_wsio>(std::make_shared<ssl_context>(cert, priv), address, sep) };
+    server.reg("echo", [](auto client, json data) -> json { return data; });
+    server.start();
+    std::thread loop([&] { sep->wait(); });
+
+    auto ep = std::make_shared<epoll>();
+    RPC::Client client(std::make_unique<client_wsio>(std::make_shared<ssl_context>(), address, ep));
+    size_t done = 0, failed = 0;
+    auto settle = [&] {
+      if (++done == calls) ep->shutdown();
+    };
+    client.start()
+        .then([&] {
+          std::string blob(12000, 'x');
+          for (size_t i = 0; i < calls; i++)
+            client.call("echo", json::array({ blob })).then([&](json) { settle(); }).fail([&](auto) {
+              failed++;
+              settle();
+            });
+          std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        })
+        .fail([&](auto) { ep->shutdown(); });
+    ep->wait();
+
+    sep->post([&] { server.stop(); });
+    sep->shutdown();
+    loop.join();
+    std::cout << done - failed << "/" << calls << " calls answered" << std::endl;
+    return done == calls && !failed ? 0 : 1;
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
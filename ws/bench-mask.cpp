@@ -0,0 +1,46 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <ws.hpp>
+
+using namespace ws;
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr size_t budget = 1 << 30;
+
+// the loop parseFrame used before applyMask
+static void legacy_mask(char *data, size_t length, char const *masking) {
+  for (size_t i = 0; i < length; i++) data[i] ^= masking[i % 4];
+}
+
+template <typename F> static double measure(size_t size, F &&f) {
+  size_t rounds = std::max(budget / std::max(size, size_t(64)), size_t(1));
+  auto start    = bench_clock::now();
+  for (size_t i = 0; i < rounds; i++) f();
+  auto elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+  return rounds * size / elapsed / (1 << 20);
+}
+
+int main() {
+  std::cout << "size\tlegacy loop\tapplyMask\tparseFrame\tparseFrameInPlace (MiB/s)" << std::endl;
+  for (size_t size : { 16, 128, 1024, 16384, 131072, 1048576 }) {
+    std::string payload(size, 'x');
+    auto frame = makeFrame({ FrameType::BINARY_FRAME, payload }, true);
+    char const masking[4] = { 1, 2, 3, 4 };
+    std::string scratch   = payload;
+
+    auto legacy = measure(size, [&] { legacy_mask(&scratch[0], size, masking); });
+    auto simd   = measure(size, [&] { applyMask(&scratch[0], size, masking); });
+    auto copied = measure(size, [&] {
+      auto parsed = parseFrame(frame);
+      if (parsed.payload.size() != size) abort();
+    });
+    // unmasking twice restores the frame, so every round parses valid masked data
+    auto inplace = measure(size, [&] {
+      auto parsed = parseFrameInPlace(&frame[0], frame.size());
+      if (parsed.payload.size() != size) abort();
+      applyMask(const_cast<char *>(parsed.payload.data()), size, parsed.payload.data() - 4);
+    });
+    std::cout << size << "\t" << (size_t)legacy << "\t\t" << (size_t)simd << "\t\t" << (size_t)copied << "\t\t" << (size_t)inplace << std::endl;
+  }
+}
@@ -1,8 +1,12 @@
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cstdio>
 #include <cstring>
 #include <experimental/iterator>
 #include <experimental/random>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <iostream>
 #include <sha1.h>
 #include <sstream>
@@ -16,17 +20,17 @@ uint64_t ntohll(uint64_t val) { return (((uint64_t)ntohl(val)) << 32) + ntohl(va
 
 uint64_t htonll(uint64_t val) { return (((uint64_t)htonl(val)) << 32) + htonl(val >> 32); }
 
+// comma separated header values, surrounding spaces removed
 std::vector<std::string_view> split(std::string_view inp) {
   std::vector<std::string_view> output;
-  size_t n = std::string_view::npos;
   while (!inp.empty()) {
-    n = inp.find_first_not_of(" ");
-    if (n == std::string_view::npos) break;
-    inp.remove_prefix(n);
-    n = inp.find_first_of(",");
+    auto n    = inp.find(',');
+    auto item = inp.substr(0, n);
+    item.remove_prefix(std::min(item.find_first_not_of(' '), item.size()));
+    item.remove_suffix(item.size() - std::min(item.find_last_not_of(' ') + 1, item.size()));
+    if (!item.empty()) output.emplace_back(item);
     if (n == std::string_view::npos) break;
-    output.emplace_back(inp.substr(0, n));
-    inp.remove_prefix(n);
+    inp.remove_prefix(n + 1);
   }
   return output;
 }
@@ -248,7 +252,8 @@ std::tuple<uint64_t, char, FrameType> getPayloadLength(Data<Input> input, ws_hea
   return { payloadLength, extraBytes, (FrameType)header.opcode };
 }
 
-Frame<Output> parseFrame(Data<Input> input) {
+// payload of the returned frame is still masked, the key is the 4 bytes in front of it
+Frame<Input> locateFrame(Data<Input> input) {
   if (input.length() < 2) return { FrameType::INCOMPLETE_FRAME };
   ws_header header{};
 #if defined(__GNUC__) && !defined(__INTEL_COMPILER) && (((__GNUC__ * 100) + __GNUC_MINOR__) >= 800)
@@ -264,12 +269,26 @@ Frame<Output> parseFrame(Data<Input> input) {
   if (opcode == FrameType::TEXT_FRAME || opcode == FrameType::BINARY_FRAME || opcode == FrameType::CLOSING_FRAME || opcode == FrameType::PING_FRAME ||
       opcode == FrameType::PONG_FRAME) {
     if (payloadLength + 6 + extraBytes > input.length()) return { FrameType::INCOMPLETE_FRAME };
-    auto masking = input.substr(2 + extraBytes, 4);
-    Frame<Output> frame{ opcode, payloadLength + 6 + extraBytes, std::string(input.substr(2 + extraBytes + 4, payloadLength)) };
-    for (size_t i = 0; i < payloadLength; i++) frame.payload[i] ^= masking[i % 4];
-    return frame;
+    return { opcode, payloadLength + 6 + extraBytes, input.substr(2 + extraBytes + 4, payloadLength) };
   }
-  return { opcode };
+  return { FrameType::ERROR_FRAME };
+}
+
+Frame<Output> parseFrame(Data<Input> input) {
+  auto located = locateFrame(input);
+  if (located.payload.data() == nullptr) return { located.type };
+  Frame<Output> frame{ located.type, located.eaten, std::string(located.payload) };
+  applyMask(&frame.payload[0], frame.payload.length(), located.payload.data() - 4);
+  return frame;
+}
+
+Frame<Input> parseFrameInPlace(char *input, size_t length) {
+  auto frame = locateFrame({ input, length });
+  if (frame.payload.data() != nullptr) {
+    auto payload = const_cast<char *>(frame.payload.data());
+    applyMask(payload, frame.payload.length(), payload - 4);
+  }
+  return frame;
 }
 
 Frame<Input> parseServerFrame(Data<Input> input) {
@@ -321,23 +340,69 @@ ws_header makeFrameHeader(Frame<Input> frame, bool mask) {
   return header;
 }
 
-Data<Output> makeFrame(Frame<Input> frame, bool mask) {
-  std::ostringstream oss;
-  oss << makeFrameHeader(frame, mask);
+size_t writeFrameHeader(char *buffer, Frame<Input> const &frame, bool mask) {
+  auto header = makeFrameHeader(frame, mask);
+  size_t length = 2;
+  memcpy(buffer, &header, 2);
+  switch (header.extra()) {
+  case 1: memcpy(buffer + length, &header.payloadLength16b, 2), length += 2; break;
+  case 2: memcpy(buffer + length, &header.payloadLength64b, 8), length += 8; break;
+  }
   if (mask) {
-    auto mask = std::experimental::randint(0u, UINT32_MAX);
-    char maskbuf[4];
-    memcpy(maskbuf, &mask, 4);
-    oss.write(maskbuf, 4);
-    size_t i = 0;
-    for (auto ch : frame.payload) {
-      char temp = ch ^ maskbuf[i++ % 4];
-      oss.write(&temp, 1);
-    }
-  } else {
-    oss << frame.payload;
+    auto key = std::experimental::randint(0u, UINT32_MAX);
+    memcpy(buffer + length, &key, 4);
+    length += 4;
   }
-  return oss.str();
+  return length;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t applyMaskAVX2(char *data, size_t length, uint32_t key) {
+  auto vkey = _mm256_set1_epi32(key);
+  size_t i  = 0;
+  for (; i + 32 <= length; i += 32) {
+    auto ptr = reinterpret_cast<__m256i *>(data + i);
+    _mm256_storeu_si256(ptr, _mm256_xor_si256(_mm256_loadu_si256(ptr), vkey));
+  }
+  return i;
+}
+#endif
+
+void applyMask(char *data, size_t length, char const *mask) {
+  uint32_t key;
+  memcpy(&key, mask, 4);
+  // every vector step is a multiple of 4 bytes, so the key stays in phase for the tail
+  size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (avx2) i = applyMaskAVX2(data, length, key);
+#endif
+#if defined(__SSE2__)
+  auto vkey = _mm_set1_epi32(key);
+  for (; i + 16 <= length; i += 16) {
+    auto ptr = reinterpret_cast<__m128i *>(data + i);
+    _mm_storeu_si128(ptr, _mm_xor_si128(_mm_loadu_si128(ptr), vkey));
+  }
+#endif
+  uint64_t key64 = (uint64_t)key << 32 | key;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t temp;
+    memcpy(&temp, data + i, 8);
+    temp ^= key64;
+    memcpy(data + i, &temp, 8);
+  }
+  for (; i < length; i++) data[i] ^= mask[i & 3];
+}
+
+Data<Output> makeFrame(Frame<Input> frame, bool mask) {
+  char header[max_frame_header];
+  auto length = writeFrameHeader(header, frame, mask);
+  std::string ret;
+  ret.reserve(length + frame.payload.length());
+  ret.append(header, length);
+  ret.append(frame.payload);
+  if (mask) applyMask(&ret[length], frame.payload.length(), header + length - 4);
+  return ret;
 }
 
 } // namespace ws
\ No newline at end of file